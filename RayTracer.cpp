@@ -1,4 +1,5 @@
 #include <iostream>
+#define NOMINMAX // keep std::min / std::max usable: no min and max macros from Windows.h
 #include <Windows.h>
 #include <thread>
 #include <mutex>
@@ -13,6 +14,7 @@
 #include <sstream>
 #include <vector>
 #include <iomanip>
+#include <typeindex>
 
 #include "ray_trace_engine.h"
 #include "vector3.h"
@@ -29,6 +31,13 @@
 #include "box.h"
 #include "constant_medium.h"
 #include "bvh.h"
+#include "flat_bvh.h"
+#include "bvh4.h"
+#include "triangle_mesh.h"
+#include "obj_loader.h"
+#include "instance.h"
+#include "tile_scheduler.h"
+#include "film.h"
 
 /*
     11 -> 2     := 550% faster without live render (50r 1s 0.5 FHD)
@@ -38,7 +47,12 @@
 
 bool LIVE_WINDOW_RENDER = false;
 bool CONSOLE_DEBUG = false;
-std::vector<float> *thread_finish_percentage;
+int RENDER_THREADS = 0; // 0 = every hardware thread
+bvh_split BVH_SPLIT = bvh_split::sah;
+bool BUILD_ACCELERATOR = true;
+int SPHERE_LEAF_SIZE = flat_bvh::default_sphere_leaf_size;
+int BOX_LEAF_SIZE = flat_bvh::default_box_leaf_size;
+int BVH_WIDTH = 4;
 
 enum class Scenes {
     Loaded,
@@ -53,7 +67,8 @@ std::vector<std::string> default_scenes = {
         "simple_light", 
         "cornell_box",
         "cornell_smoke",
-        "all_features_scene"
+        "instanced_boxes",
+        "all_features_scene" // last entry: the default scene
 };
 
 // Define a mutex for synchronizing access to SetPixel function
@@ -156,6 +171,39 @@ int DrawBufferToWindow(HWND hwnd, HDC hdc, int width, int height, const std::vec
 #pragma endregion
 
 #pragma region Preloaded worlds
+shared_ptr<hittable> build_bvh(const hittable_list& objects, double time0, double time1)
+{
+    auto build_start = std::chrono::high_resolution_clock::now();
+    bvh_node tree(objects, time0, time1, BVH_SPLIT);
+    shared_ptr<flat_bvh> binary;
+    shared_ptr<bvh4> wide;
+    if (BVH_WIDTH == 4)
+        wide = make_shared<bvh4>(tree, time0, time1, SPHERE_LEAF_SIZE, BOX_LEAF_SIZE);
+    else
+        binary = make_shared<flat_bvh>(tree, time0, time1, SPHERE_LEAF_SIZE, BOX_LEAF_SIZE);
+    auto build_end = std::chrono::high_resolution_clock::now();
+
+    auto build_ms = std::chrono::duration_cast<std::chrono::microseconds>(build_end - build_start).count() / 1000.0;
+    std::cout << "BVH build: " << objects.objects.size() << " objects in " << build_ms << " ms" << std::endl;
+
+    if (CONSOLE_DEBUG){
+        // A bvh_node lives in its own make_shared block, roughly two pointers of control data each.
+        size_t tree_bytes = tree.node_count() * (sizeof(bvh_node) + 2 * sizeof(void*));
+        size_t node_count = wide ? wide->nodes.size() : binary->nodes.size();
+        size_t bytes = wide ? wide->memory_bytes() : binary->memory_bytes();
+        size_t sphere_sets = wide ? wide->sphere_set_count : binary->sphere_set_count;
+        size_t box_sets = wide ? wide->box_set_count : binary->box_set_count;
+        std::cout << "BVH (" << (BVH_SPLIT == bvh_split::sah ? "sah" : "random axis") << ", " << (wide ? 4 : 2) << " wide): "
+            << "SAH cost " << tree.sah_cost()
+            << ", " << node_count << " flat nodes, " << bytes << " bytes (tree: " << tree_bytes << " bytes)"
+            << ", " << sphere_sets << " sphere sets, " << box_sets << " box sets, " << cpu_features::name(cpu_features::level) << " kernels, "
+            << (sizeof(real) == sizeof(float) ? "single" : "double") << " precision" << std::endl;
+    }
+    if (wide)
+        return wide;
+    return binary;
+}
+
 hittable_list two_spheres()
 {
     hittable_list objects;
@@ -382,7 +430,7 @@ hittable_list all_features_scene(){
 
     hittable_list objects;
 
-    objects.add(make_shared<bvh_node>(boxes1, 0, 1));
+    objects.add(build_bvh(boxes1, 0, 1));
 
     auto light = make_shared<diffuse_light>(color(7, 7, 7));
     objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
@@ -418,13 +466,56 @@ hittable_list all_features_scene(){
 
     objects.add(make_shared<translate>(
         make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
+            build_bvh(boxes2, 0.0, 1.0), 15),
         vector3(-100, 270, 395)
     )
     );
 
     return objects;
 }
+hittable_list instanced_boxes(){
+    hittable_list objects;
+
+    auto ground = make_shared<lambertian>(make_shared<checker_texture>(color(0.3, 0.3, 0.35), color(0.8, 0.8, 0.8)));
+    objects.add(make_shared<xz_rect>(-1000, 1000, -1000, 1000, 0, ground));
+
+    // One cluster of boxes, stored once and placed 100k times.
+    hittable_list cluster;
+    auto red = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto gold = make_shared<metal>(color(0.8, 0.6, 0.2), 0.2);
+    cluster.add(make_shared<box>(point3(-1, 0, -1), point3(1, 0.4, 1), white));
+    cluster.add(make_shared<box>(point3(-0.6, 0.4, -0.6), point3(0.2, 1.6, 0.2), red));
+    cluster.add(make_shared<box>(point3(0.3, 0.4, 0.1), point3(0.8, 0.9, 0.6), gold));
+    cluster.add(make_shared<sphere>(point3(0.5, 1.1, -0.5), 0.3, make_shared<dielectric>(1.5)));
+    auto shared_cluster = build_bvh(cluster, 0, 1);
+
+    const int copies_per_side = 317;
+    auto instances = make_shared<instance_set>();
+    for (int a = 0; a < copies_per_side; a++)
+    {
+        for (int b = 0; b < copies_per_side; b++)
+        {
+            vector3 offset(4.0 * (a - copies_per_side / 2) + random_double(-1, 1), 0, 4.0 * (b - copies_per_side / 2) + random_double(-1, 1));
+            auto placement = affine_transform::translation(offset)
+                * affine_transform::rotation_y(random_double(0, 360))
+                * affine_transform::scaling(vector3(1, 1, 1) * random_double(0.5, 1.2));
+            instances->add(shared_cluster, placement);
+        }
+    }
+
+    auto build_start = std::chrono::high_resolution_clock::now();
+    instances->build();
+    auto build_end = std::chrono::high_resolution_clock::now();
+    std::cout << "Instances: " << instances->instance_count() << " copies of " << instances->object_count() << " object, top level BVH in "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(build_end - build_start).count() << " ms, "
+        << double(instances->memory_bytes()) / instances->instance_count() << " bytes per instance" << std::endl;
+    objects.add(instances);
+
+    objects.add(make_shared<sphere>(point3(0, 2000, 0), 500, make_shared<diffuse_light>(color(4, 4, 4))));
+
+    return objects;
+}
 #pragma endregion
 
 #pragma region utility functions
@@ -433,8 +524,86 @@ void OpenFile(std::string file)
     system(("start " + file).c_str());
 }
 
+// Box tests per second of the slab tests traversals use, against the per-axis division
+// test aabb::hit used before rays carried their reciprocal direction.
+void RunBoxTestBenchmark()
+{
+    const int box_count = 1024, ray_count = 4096, rounds = 8;
+
+    std::vector<aabb> boxes;
+    std::vector<flat_bvh_node> nodes;
+    box_set set;
+    for (int i = 0; i < box_count; i++)
+    {
+        point3 lo = point3::random(0, 100);
+        aabb b(lo, lo + vector3::random(1, 20));
+        boxes.push_back(b);
+        set.add(b.minim(), b.maxim(), handle_table<material>::none);
+
+        flat_bvh_node node = {};
+        for (int a = 0; a < 3; a++)
+        {
+            node.bounds_min[a] = flat_bvh::round_down(b.minim()[a]);
+            node.bounds_max[a] = flat_bvh::round_up(b.maxim()[a]);
+        }
+        nodes.push_back(node);
+    }
+
+    std::vector<ray> rays;
+    for (int i = 0; i < ray_count; i++)
+        rays.push_back(ray(point3::random(-20, 120), random_unit_vector()));
+
+    auto division_test = [](const aabb& b, const ray& r, double t_min, double t_max) {
+        for (int a = 0; a < 3; a++)
+        {
+            auto t0 = fmin((b.minimum[a] - r.origin()[a]) / r.direction()[a], (b.maximum[a] - r.origin()[a]) / r.direction()[a]);
+            auto t1 = fmax((b.minimum[a] - r.origin()[a]) / r.direction()[a], (b.maximum[a] - r.origin()[a]) / r.direction()[a]);
+            t_min = fmax(t0, t_min);
+            t_max = fmin(t1, t_max);
+            if (t_max <= t_min)
+                return false;
+        }
+        return true;
+    };
+
+    auto measure = [&](const char* name, auto test) {
+        size_t hits = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < rounds; round++)
+            for (const ray& r : rays)
+                hits += test(r);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double tests = double(rounds) * ray_count * box_count;
+        std::cout << std::left << std::setw(34) << name << std::right << std::setw(8) << std::fixed << std::setprecision(1)
+            << tests / seconds / 1e6 << " M box tests/s (" << hits << " hits)" << std::endl;
+        std::cout.unsetf(std::ios::fixed);
+    };
+
+    std::cout << "Box test benchmark: " << ray_count << " rays x " << box_count << " boxes x " << rounds << " rounds, "
+        << cpu_features::name(cpu_features::level) << " kernels" << std::endl;
+    measure("division slab test (before)", [&](const ray& r) {
+        size_t hits = 0;
+        for (const aabb& b : boxes) hits += division_test(b, r, 0.001, infinity);
+        return hits;
+    });
+    measure("aabb::hit (bvh_node)", [&](const ray& r) {
+        size_t hits = 0;
+        for (const aabb& b : boxes) hits += b.hit(r, 0.001, infinity);
+        return hits;
+    });
+    measure("flat_bvh::node_hit (float bounds)", [&](const ray& r) {
+        size_t hits = 0;
+        for (const flat_bvh_node& node : nodes) hits += flat_bvh::node_hit(node, r, 0.001, infinity);
+        return hits;
+    });
+    measure("box_set (closest of all)", [&](const ray& r) {
+        double t_max = infinity;
+        return size_t(set.intersect(r, 0.001, t_max, false) >= 0);
+    });
+}
+
 int WaitForUserInput_Start(){
-    std::cout << "Commands:\n\tStart\n\tHelp\n\tStop" << std::endl;
+    std::cout << "Commands:\n\tStart\n\tHelp\n\tBench\n\tStop" << std::endl;
     std::cout << "c << ";
 
     std::string command;
@@ -451,6 +620,9 @@ int WaitForUserInput_Start(){
     }else if (command == "start"){
         //can continue
         return 0;
+    }else if (command == "bench"){
+        RunBoxTestBenchmark();
+        return WaitForUserInput_Start();
     }else if(command == "help") {
         std::cout << "Creating and opening help file: " << std::endl;
     }else{
@@ -475,12 +647,41 @@ int WaitForUserInput_Start(){
         "image_width = 1920\n"
         "max_color = 255\n"
         "samples_per_pixel = 2048\n"
-        "max_depth = 64\n\n"
+        "max_depth = 64\n"
+        "rr_start_depth = 3\n"
+        "light_sampling = 1\n"
+        "tile_size = 32\n"
+        "packet_size = 0\n"
+        "integrator = path\n"
+        "samples_per_pass = 0\n"
+        "time_budget = 0\n"
+        "adaptive_sampling = 0\n"
+        "min_spp = 16\n"
+        "max_spp = 0\n"
+        "adaptive_threshold = 0.005\n"
+        "sample_heatmap = 0\n\n"
         "camera_configuration = camera_demo.txt\n"
         "scene_name = demo.scene\n\n"
         "LIVE_WINDOW_RENDER = 0\n"
-        "CONSOLE_DEBUG = 0\n\n"
-        "Where the basic image properties are defined, as well as the camera configuration file and scene file.\n\n"
+        "CONSOLE_DEBUG = 0\n"
+        "render_threads = 0\n"
+        "bvh_builder = sah\n"
+        "bvh_width = 4\n"
+        "sphere_leaf_size = 16\n"
+        "box_leaf_size = 4\n"
+        "simd = avx512\n"
+        "sampler = independent\n"
+        "seed = 0\n\n"
+        "Where the basic image properties are defined, as well as the camera configuration file and scene file.\n"
+        "max_depth is a hard cap on bounces; from bounce rr_start_depth on, paths are ended early by Russian roulette weighted by their remaining energy.\n"
+        "light_sampling = 1 samples the emissive objects (diffuse_light spheres and rects) directly at every diffuse hit, which makes small lights converge much faster.\n"
+        "sampler selects the numbers each camera sample is built from: independent (white noise), sobol (Owen scrambled Sobol points, which cover the pixel, lens and bounce directions evenly and reach the same noise level with fewer samples_per_pixel) or blue_noise (the same sequence for every pixel, offset by a blue noise mask so the remaining noise is fine grained). Best with powers of two samples_per_pixel.\n"
+        "bvh_builder selects how the scene acceleration structure is built: sah, random or none. bvh_width = 4 collapses it into 4-wide nodes whose children are tested together with SIMD instructions, 2 keeps the binary tree.\n"
+        "sphere_leaf_size and box_leaf_size pack up to that many spheres or boxes into one BVH leaf that is intersected with SIMD instructions (0 = off); simd caps the instruction set used for it: avx512, avx2, sse2 or scalar (the CPU's best is used when it supports less).\n"
+        "packet_size = 4 or 8 traces the camera rays of 4x4 or 8x8 pixel blocks through the BVH together (0 = one ray at a time), which speeds up high resolution, low sample previews; bounces after the first hit are always traced one by one.\n"
+        "integrator = wavefront traces the samples of a tile as one batch of paths, stage by stage (intersection, shading grouped by material type, shadow rays, Russian roulette), instead of one path at a time (path); the image is the same. packet_size is not used with it.\n"
+        "samples_per_pass > 0 renders progressively, publishing the image after every pass; time_budget (seconds, 0 = none) stops after the pass that runs out of time.\n"
+        "adaptive_sampling = 1 spends samples_per_pixel * pixels samples where the image is still noisy: every pixel takes min_spp samples, then stops once its error is below adaptive_threshold (display units, 1/255 = one 8-bit step) or it reaches max_spp (0 = 4 x samples_per_pixel). sample_heatmap = 1 writes the per-pixel sample counts to sample_heatmap.png.\n\n"
         "Note: scene_name has a special configuration:\n"
         "scene_name = preloaded [preloaded scene]\n"
         "where [preloaded scene] are scene hard written into the program, these are:\n\n";
@@ -502,7 +703,7 @@ int WaitForUserInput_Start(){
         "And Lastly scene.scene, or any file defined in the configuration\n"
         "You can define \"background_color\" with r, g, b values\n"
         "Every object is defined on a separate line, following this structure:\n"
-        "Object (currently only \"sphere\") \"position\" with x, y, z doubles, \"radius\" with double r, \"material\" with these possibilities:\n\n";
+        "Object (\"sphere\" or \"mesh\") \"position\" with x, y, z doubles, \"radius\" with double r, \"material\" with these possibilities:\n\n";
 
     // Assuming you have a vector<string> named possible_materials containing the material names
     std::vector<std::string> possible_materials = {
@@ -528,6 +729,8 @@ int WaitForUserInput_Start(){
         "sphere position -4 1 0 radius 1 material normal 0.1 0.1 0.1\n"
         "sphere position 4 1 0 radius 1 material metal 0.7 0.7 0.70\n"
         "sphere position -10.1731 0.2 -3.99209 radius 0.2 material lambertian_color 0.427085 0.228567 0.190677\n\n"
+        "A mesh loads the triangles of a Wavefront OBJ file instead, scaled by \"scale\" and then moved by \"position\":\n"
+        "mesh file bunny.obj position 0 0 0 scale 10 material lambertian_color 0.8 0.8 0.8\n\n"
         "For more info refer to: https://aliph-null.github.io/\n";
 
     file.close();
@@ -537,9 +740,9 @@ int WaitForUserInput_Start(){
     return 0;
 }
 
-void DataToPng(const char* pngFileName, int width, int height, std::vector<unsigned char>& pixels)
+void DataToPng(const char* pngFileName, int width, int height, std::vector<unsigned char>& pixels, bool verbose = true)
 {
-    std::cout << "Converting to png" << std::endl;
+    if (verbose) std::cout << "Converting to png" << std::endl;
     // Write PNG file
     FILE* pngFile;// = fopen(pngFileName, "wb");
     if (fopen_s(&pngFile, pngFileName, "wb") != 0)
@@ -583,10 +786,61 @@ void DataToPng(const char* pngFileName, int width, int height, std::vector<unsig
     fclose(pngFile);
     delete[] rowPointers;
 
-    std::cout << "Conversion successful!" << std::endl;
+    if (verbose) std::cout << "Conversion successful!" << std::endl;
+}
+
+// Writes the per-pixel sample counts as a blue (fewest) to red (most) image.
+void WriteSampleHeatmap(const char* pngFileName, const film& accumulation)
+{
+    int max_samples = *std::max_element(accumulation.samples.begin(), accumulation.samples.end());
+
+    std::vector<unsigned char> heatmap(accumulation.width * accumulation.height * 3);
+    for (int pixel = 0; pixel < accumulation.width * accumulation.height; pixel++){
+        double t = clamp(double(accumulation.sample_count(pixel)) / std::max(max_samples, 1), 0.0, 1.0);
+        heatmap[pixel * 3 + 0] = static_cast<unsigned char>(255 * t);
+        heatmap[pixel * 3 + 1] = static_cast<unsigned char>(255 * (1 - fabs(2 * t - 1)));
+        heatmap[pixel * 3 + 2] = static_cast<unsigned char>(255 * (1 - t));
+    }
+    DataToPng(pngFileName, accumulation.width, accumulation.height, heatmap, false);
+}
+
+void Render(camera& cam, image& img, hittable_list& world, hittable_list& lights);
+
+// Puts everything that has a bounding box under one BVH. Objects without one (if any)
+// stay in a small list that is tested linearly next to it.
+hittable_list build_world_accelerator(const hittable_list& world)
+{
+    if (!BUILD_ACCELERATOR) return world;
+
+    hittable_list bounded;
+    hittable_list accelerated;
+
+    for (const auto& object : world.objects){
+        aabb box;
+        if (object->bounding_box(0, 1, box)) bounded.add(object);
+        else accelerated.add(object);
+    }
+
+    if (!bounded.objects.empty()){
+        accelerated.add(build_bvh(bounded, 0, 1));
+    }
+
+    if (CONSOLE_DEBUG) std::cout << "Accelerator: " << bounded.objects.size() << " objects in the BVH, " << world.objects.size() - bounded.objects.size() << " unbounded." << std::endl;
+    return accelerated;
 }
 
-void Render(camera& cam, image& img, hittable_list& world);
+// Emitters that can be sampled directly. Only top level objects are considered, lights
+// inside transforms or BVHs are still found by the scattered rays alone.
+hittable_list collect_lights(const hittable_list& world)
+{
+    hittable_list lights;
+    for (const auto& object : world.objects){
+        if (object->is_light()) lights.add(object);
+    }
+
+    if (CONSOLE_DEBUG) std::cout << "Lights: " << lights.objects.size() << " sampled directly." << std::endl;
+    return lights;
+}
 
 hittable_list create_scene_from_file(std::string scene_name, image &img){
     hittable_list world;
@@ -613,6 +867,8 @@ hittable_list create_scene_from_file(std::string scene_name, image &img){
         double radius;
         std::string materialType;
         std::string image_texture_file;
+        std::string mesh_file;
+        double mesh_scale = 1;
         std::string object_type = "sphere";
 
         for (char& c : object_type){
@@ -636,6 +892,10 @@ hittable_list create_scene_from_file(std::string scene_name, image &img){
                 position = vector3(x, y, z);
             }else if (token == "radius"){
                 iss >> radius;
+            }else if (token == "file"){
+                iss >> std::ws >> mesh_file;
+            }else if (token == "scale"){
+                iss >> mesh_scale;
             }else if (token == "material"){
                 iss >> materialType;
 
@@ -697,7 +957,24 @@ hittable_list create_scene_from_file(std::string scene_name, image &img){
             material = make_shared<diffuse_light>(rgb1);
         }
 
-        world.add(make_shared<sphere>(position, radius, material));
+        if (object_type == "mesh"){
+            auto load_start = std::chrono::high_resolution_clock::now();
+            triangle_mesh_data data;
+            if (obj_loader::load(mesh_file, data, mesh_scale, position)){
+                auto load_end = std::chrono::high_resolution_clock::now();
+                auto mesh = make_shared<triangle_mesh>(std::move(data), material);
+                auto build_end = std::chrono::high_resolution_clock::now();
+
+                auto load_ms = std::chrono::duration_cast<std::chrono::microseconds>(load_end - load_start).count() / 1000.0;
+                auto build_ms = std::chrono::duration_cast<std::chrono::microseconds>(build_end - load_end).count() / 1000.0;
+                std::cout << "Mesh " << mesh_file << ": " << mesh->triangle_count() << " triangles, " << mesh->mesh.positions.size() << " vertices, "
+                    << "loaded in " << load_ms << " ms, BVH in " << build_ms << " ms, "
+                    << double(mesh->memory_bytes()) / mesh->triangle_count() << " bytes per triangle" << std::endl;
+                world.add(mesh);
+            }
+        }else{
+            world.add(make_shared<sphere>(position, radius, material));
+        }
         count++;
     }
 
@@ -762,6 +1039,7 @@ camera create_camera_from_file(std::string &cam_config_file, double aspect_ratio
 
 int LoadScene(Scenes scene, hittable_list &world, std::string scene_file, camera &cam, std::string camera_config_file, image &img){
     std::cout << "Loading Scene\n";
+    thread_sampler.start_scene();
     color default_background_color = color(0.7, 0.8, 1);
     img.background_color = default_background_color;
 
@@ -826,6 +1104,16 @@ int LoadScene(Scenes scene, hittable_list &world, std::string scene_file, camera
             img.background_color = color(0.2, 0.2, 0.2);
             return 0;
         }else if (scene_file == default_scenes[8]) {
+            world = instanced_boxes();
+
+            img.aspect_ratio = 16.0 / 9.0;
+            img.image_width = 800;
+            img.image_height = 450;
+
+            cam = camera(point3(-24, 14, -24), point3(10, 0, 10), vector3(0, 1, 0), 40, img.aspect_ratio, 0.0, 10, 0, 0);
+            img.background_color = color(0.70, 0.80, 1.00);
+            return 0;
+        }else if (scene_file == default_scenes[9]) {
             world = all_features_scene();
 
             img.aspect_ratio = 1;
@@ -853,81 +1141,431 @@ int LoadScene(Scenes scene, hittable_list &world, std::string scene_file, camera
 #pragma endregion
 
 #pragma region ray
-color ray_color(const ray& r, const color& background, const hittable& world, int depth)
+// Power heuristic (beta = 2) weight of a sample drawn with pdf_a, when the same direction
+// could also have been drawn with pdf_b.
+inline double mis_weight(double pdf_a, double pdf_b)
 {
-    hit_record rec;
+    double a = pdf_a * pdf_a;
+    double b = pdf_b * pdf_b;
+    return a + b > 0 ? a / (a + b) : 0;
+}
 
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
-        return color(0, 0, 0);
+// Iterative path tracer. The path carries its throughput (the product of all attenuations
+// so far) instead of recursing, and after rr_start_depth bounces it is randomly terminated
+// with a probability that grows as its throughput drops (Russian roulette). Survivors are
+// reweighted by 1 / survival probability, so the estimate stays unbiased.
+// max_depth is only a hard safety cap.
+//
+// At every non-specular hit one direction towards the lights is sampled and traced as a
+// shadow ray (next event estimation). Emitters can then be reached both by that light
+// sample and by the scattered ray, so both are weighted with multiple importance sampling.
+color ray_color(const ray& r, const color& background, const hittable& world, const hittable_list& lights, int max_depth, int rr_start_depth, const hit_record* primary_hit = nullptr)
+{
+    color radiance(0, 0, 0);
+    color throughput(1, 1, 1);
+    ray current = r;
+
+    // Density with which the previous vertex scattered into current, 0 after a specular
+    // bounce or the camera, where light sampling could not have found the same path.
+    double scatter_pdf = 0;
+    point3 scatter_origin;
+
+    for (int depth = 0; depth < max_depth; depth++){
+        hit_record rec;
+        bool hit_anything;
+
+        if (depth == 0 && primary_hit){
+            // Camera rays traced in a packet arrive with their first hit, found in this bounce's stream.
+            rec = *primary_hit;
+            hit_anything = rec.prim != nullptr;
+        }else{
+            // Each bounce draws from its own stream, keyed by pixel, sample and bounce.
+            thread_sampler.next_bounce();
+            traversal_stats::count_rays();
+            hit_anything = world.hit(current, surface_t_min(current), infinity, rec);
+        }
 
-    // If the ray hits nothing, return the background color.
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
+        // If the ray hits nothing, gather the background color.
+        if (!hit_anything){
+            radiance += throughput * background;
+            break;
+        }
+        rec.prim->finalize(current, rec);
+        const material* mat = scene_materials[rec.mat];
+
+        color emitted = mat->emitted(rec.u, rec.v, rec.p);
+        if (scatter_pdf > 0 && mat->is_emissive() && !lights.objects.empty())
+            emitted *= mis_weight(scatter_pdf, lights.pdf_value(scatter_origin, current.direction()));
+        radiance += throughput * emitted;
+
+        ray scattered;
+        color attenuation;
+        if (!mat->scatter(current, rec, attenuation, scattered))
+            break;
+
+        // attenuation is f * cos / scattering_pdf for the material's own samples, so a
+        // light sample in direction d contributes attenuation * scattering_pdf(d) / light_pdf.
+        if (!lights.objects.empty()){
+            ray shadow(rec.p, lights.random(rec.p), current.time());
+            double material_pdf = mat->scattering_pdf(current, rec, shadow);
+            double light_pdf = material_pdf > 0 ? lights.pdf_value(rec.p, shadow.direction()) : 0;
+
+            // Find the light point on the (short) light list, then only ask the world whether
+            // anything lies in front of it.
+            hit_record light_rec;
+            if (light_pdf > 0 && lights.hit(shadow, surface_t_min(shadow), infinity, light_rec)){
+                traversal_stats::count_rays();
+                if (!world.occluded(shadow, surface_t_min(shadow), light_rec.t * (1 - 1e-4))){
+                    light_rec.prim->finalize(shadow, light_rec);
+                    color light = scene_materials[light_rec.mat]->emitted(light_rec.u, light_rec.v, light_rec.p);
+                    radiance += throughput * attenuation * light * (material_pdf / light_pdf * mis_weight(light_pdf, material_pdf));
+                }
+            }
+        }
 
-    ray scattered;
+        scatter_pdf = mat->scattering_pdf(current, rec, scattered);
+        scatter_origin = rec.p;
+        throughput = throughput * attenuation;
+
+        if (depth + 1 >= rr_start_depth){
+            double survival = fmin(1.0, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+            if (random_double() >= survival)
+                break;
+            throughput /= survival;
+        }
+
+        current = scattered;
+    }
+
+    return radiance;
+}
+#pragma endregion
+
+#pragma region Wavefront integrator
+// The same estimator as ray_color, but run one stage at a time over a whole batch of
+// paths: intersect every live path, shade the hits grouped by material type, test all
+// light samples for occlusion, then end or continue every path. Each stage runs the same
+// code over many paths in a row, instead of alternating between traversal and every
+// material's scatter per ray. Every path keeps its own random stream, so the result is
+// identical to ray_color.
+
+// Everything one path carries from one stage to the next.
+struct path_state {
+    int pixel;
+    sampler stream;
+    ray current;
+    color throughput;
+    color radiance;
+    double scatter_pdf; // as in ray_color
+    point3 scatter_origin;
+    hit_record rec;
+
+    // Scatter result, applied once the light sample has been tested.
     color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
+    ray scattered;
+
+    // Light sample waiting for its shadow test.
+    ray shadow;
+    double shadow_t_max;
+    color shadow_radiance;
+};
+
+// Paths and stage queues reused by every batch of a render thread.
+struct wavefront_batch {
+    static constexpr size_t max_paths = 1 << 12;
+
+    std::vector<path_state> paths;
+    std::vector<int> live, hits, shading_order, shadows, continuing;
+    std::vector<int> kind_start; // counting sort offsets, kind_count + 1 of them
+
+    // Small dense ids for the dynamic types of the scene's materials, by material handle.
+    std::vector<int> material_kind;
+    int kind_count = 0;
+
+    wavefront_batch()
+    {
+        std::vector<std::type_index> kinds;
+        for (material_handle h = 0; h < scene_materials.size(); h++){
+            std::type_index kind = typeid(*scene_materials[h]);
+            auto found = std::find(kinds.begin(), kinds.end(), kind);
+            material_kind.push_back(static_cast<int>(found - kinds.begin()));
+            if (found == kinds.end()) kinds.push_back(kind);
+        }
+        kind_count = static_cast<int>(kinds.size());
+    }
+};
 
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
+void trace_wavefront(wavefront_batch& batch, const image& img, const hittable& world, const hittable_list& lights)
+{
+    std::vector<path_state>& paths = batch.paths;
+
+    batch.live.resize(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) batch.live[i] = static_cast<int>(i);
+
+    for (int depth = 0; depth < img.max_depth && !batch.live.empty(); depth++){
+        // Intersection: closest hits of every live path.
+        batch.hits.clear();
+        for (int i : batch.live){
+            path_state& path = paths[i];
+            thread_sampler = path.stream;
+            thread_sampler.next_bounce();
+            traversal_stats::count_rays();
+
+            if (world.hit(path.current, surface_t_min(path.current), infinity, path.rec)){
+                path.rec.prim->finalize(path.current, path.rec);
+                batch.hits.push_back(i);
+            }else{
+                path.radiance += path.throughput * img.background_color;
+            }
+            path.stream = thread_sampler;
+        }
+
+        // Counting sort of the hits by material type, stable within a type.
+        std::vector<int>& kind_start = batch.kind_start;
+        kind_start.assign(batch.kind_count + 1, 0);
+        for (int i : batch.hits) kind_start[batch.material_kind[paths[i].rec.mat] + 1]++;
+        for (int k = 0; k < batch.kind_count; k++) kind_start[k + 1] += kind_start[k];
+        batch.shading_order.resize(batch.hits.size());
+        for (int i : batch.hits) batch.shading_order[kind_start[batch.material_kind[paths[i].rec.mat]]++] = i;
+
+        // Shading: emission, scattering and the light sample of every hit.
+        batch.shadows.clear();
+        batch.continuing.clear();
+        for (int i : batch.shading_order){
+            path_state& path = paths[i];
+            thread_sampler = path.stream;
+            const material* mat = scene_materials[path.rec.mat];
+
+            color emitted = mat->emitted(path.rec.u, path.rec.v, path.rec.p);
+            if (path.scatter_pdf > 0 && mat->is_emissive() && !lights.objects.empty())
+                emitted *= mis_weight(path.scatter_pdf, lights.pdf_value(path.scatter_origin, path.current.direction()));
+            path.radiance += path.throughput * emitted;
+
+            if (!mat->scatter(path.current, path.rec, path.attenuation, path.scattered)){
+                path.stream = thread_sampler;
+                continue;
+            }
+
+            if (!lights.objects.empty()){
+                ray shadow(path.rec.p, lights.random(path.rec.p), path.current.time());
+                double material_pdf = mat->scattering_pdf(path.current, path.rec, shadow);
+                double light_pdf = material_pdf > 0 ? lights.pdf_value(path.rec.p, shadow.direction()) : 0;
+
+                hit_record light_rec;
+                if (light_pdf > 0 && lights.hit(shadow, surface_t_min(shadow), infinity, light_rec)){
+                    traversal_stats::count_rays();
+                    light_rec.prim->finalize(shadow, light_rec);
+                    color light = scene_materials[light_rec.mat]->emitted(light_rec.u, light_rec.v, light_rec.p);
+                    path.shadow = shadow;
+                    path.shadow_t_max = light_rec.t * (1 - 1e-4);
+                    path.shadow_radiance = path.throughput * path.attenuation * light * (material_pdf / light_pdf * mis_weight(light_pdf, material_pdf));
+                    batch.shadows.push_back(i);
+                }
+            }
+
+            path.scatter_pdf = mat->scattering_pdf(path.current, path.rec, path.scattered);
+            path.scatter_origin = path.rec.p;
+            path.stream = thread_sampler;
+            batch.continuing.push_back(i);
+        }
 
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
+        // Shadow rays: any hit queries only.
+        for (int i : batch.shadows){
+            path_state& path = paths[i];
+            thread_sampler = path.stream;
+            if (!world.occluded(path.shadow, surface_t_min(path.shadow), path.shadow_t_max))
+                path.radiance += path.shadow_radiance;
+            path.stream = thread_sampler;
+        }
+
+        // Russian roulette and the rays of the next bounce.
+        batch.live.clear();
+        for (int i : batch.continuing){
+            path_state& path = paths[i];
+            thread_sampler = path.stream;
+            path.throughput = path.throughput * path.attenuation;
+
+            bool survives = true;
+            if (depth + 1 >= img.rr_start_depth){
+                double survival = fmin(1.0, fmax(path.throughput.x(), fmax(path.throughput.y(), path.throughput.z())));
+                survives = random_double() < survival;
+                if (survives) path.throughput /= survival;
+            }
+            if (survives){
+                path.current = path.scattered;
+                batch.live.push_back(i);
+            }
+            path.stream = thread_sampler;
+        }
+    }
 }
 #pragma endregion
 
 #pragma region Thread stuff
-void ThreadRender(int start, int end, std::vector<unsigned char>& image_buffer, image &img, camera &cam, hittable_list &world, std::vector<float> &finish_percentage, int id){
-    for (int i = start; i < end; i++){
-        for (int j = 0; j < img.image_width; j++){
-            //Buffer Coordinate
-            int pixel = i * img.image_width + j;
+// One progressive pass: samples [first_sample, first_sample + sample_count) of every pixel.
+struct render_pass {
+    int first_sample;
+    int sample_count;
+    std::chrono::steady_clock::time_point deadline; // end of the time budget, max() when unlimited
+};
+
+// Starts the stream of sample s of a pixel and draws its jittered camera ray.
+ray camera_ray(const image& img, const camera& cam, int pixel, int s)
+{
+    //UV coordinates
+    int uv_x = pixel % img.image_width;
+    int uv_y = img.image_height - 1 - pixel / img.image_width;
+
+    thread_sampler.start_pixel_sample(pixel, s, uv_x, pixel / img.image_width);
+    auto u = double(uv_x + random_double()) / (img.image_width - 1);
+    auto v = double(uv_y + random_double()) / (img.image_height - 1);
+    return cam.get_ray(u, v);
+}
+
+// One sample round of a block of pixels: the camera rays of every pixel that still takes a
+// sample are traced to their first hit together, then each path carries on alone.
+void trace_packet(ray_packet& packet, film& accumulation, const image& img, const camera& cam, const hittable& world, const hittable_list& lights,
+    int round, int pixel_count, const int pixels[], const int first_sample[], const int sample_count[])
+{
+    int members[ray_packet::max_size];
+    packet.size = 0;
+    for (int k = 0; k < pixel_count; k++){
+        if (round >= sample_count[k]) continue;
+
+        int m = packet.size++;
+        members[m] = k;
+        packet.rays[m] = camera_ray(img, cam, pixels[k], first_sample[k] + round);
+        thread_sampler.next_bounce();
+        packet.streams[m] = thread_sampler;
+        packet.t_min[m] = surface_t_min(packet.rays[m]);
+        packet.t_max[m] = infinity;
+        packet.recs[m] = hit_record();
+    }
 
-            //UV coordinates
-            int uv_x = j;
-            int uv_y = img.image_height - 1 - i;
-
-            //Rendering
-            // UV's
-            //ray r(origin, lower_left_corner + u * horizontal + v * vertical - origin);
-            //color pixel_color = ray_color(r, world);
-            //write_color(image, pixel, pixel_color);
-
-            color pixel_color(0, 0, 0);
-            for (int s = 0; s < img.samples_per_pixel; ++s){
-                auto u = double(uv_x + random_double()) / (img.image_width - 1);
-                auto v = double(uv_y + random_double()) / (img.image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, img.background_color, world, img.max_depth);
-                
+    traversal_stats::count_rays(packet.size);
+    world.hit_packet(packet);
+
+    for (int m = 0; m < packet.size; m++){
+        thread_sampler = packet.streams[m];
+        accumulation.add_sample(pixels[members[m]], ray_color(packet.rays[m], img.background_color, world, lights, img.max_depth, img.rr_start_depth, &packet.recs[m]));
+    }
+}
+
+// Copies the pixel's current estimate to the live window.
+void show_live_pixel(film& accumulation, std::vector<unsigned char>& image_buffer, const image& img, int pixel){
+    accumulation.develop(image_buffer, pixel);
+    mtx.lock();
+    COLORREF win_color = RGB(image_buffer[pixel * 3], image_buffer[pixel * 3 + 1], image_buffer[pixel * 3 + 2]);
+    // Set the color of the pixel at the specified coordinates
+    SetPixel(globalHDC, pixel % img.image_width, pixel / img.image_width, win_color);
+    mtx.unlock();
+}
+
+// Samples the tile wants in this pass, for each of its pixels: how many and from which index.
+// Sample indices continue from what the pixel already has, so the sampler keys do not
+// depend on how the samples were split into passes.
+int pass_samples(const film& accumulation, const image& img, const render_pass& pass, int pixel, int& first_sample){
+    first_sample = accumulation.sample_count(pixel);
+    return img.adaptive.enabled ? img.adaptive.samples_wanted(accumulation, pixel, pass.sample_count) : pass.sample_count;
+}
+
+// All samples of a tile with the wavefront integrator, in batches of at most max_paths paths.
+void trace_tile_wavefront(wavefront_batch& batch, film& accumulation, const image& img, const camera& cam, const hittable& world, const hittable_list& lights, const tile& t, const render_pass& pass){
+    batch.paths.clear();
+    auto flush = [&](){
+        trace_wavefront(batch, img, world, lights);
+        for (const path_state& path : batch.paths)
+            accumulation.add_sample(path.pixel, path.radiance);
+        batch.paths.clear();
+    };
+
+    for (int i = t.y0; i < t.y1; i++){
+        for (int j = t.x0; j < t.x1; j++){
+            int pixel = i * img.image_width + j;
+            int first_sample;
+            int sample_count = pass_samples(accumulation, img, pass, pixel, first_sample);
+
+            for (int s = first_sample; s < first_sample + sample_count; ++s){
+                path_state path;
+                path.pixel = pixel;
+                path.current = camera_ray(img, cam, pixel, s);
+                path.stream = thread_sampler;
+                path.throughput = color(1, 1, 1);
+                path.scatter_pdf = 0;
+                batch.paths.push_back(path);
+                if (batch.paths.size() == wavefront_batch::max_paths) flush();
             }
-            write_color(image_buffer, pixel, pixel_color, img.samples_per_pixel);
+        }
+    }
+    if (!batch.paths.empty()) flush();
+}
 
+void ThreadRender(tile_scheduler& scheduler, film& accumulation, std::vector<unsigned char>& image_buffer, image &img, camera &cam, hittable_list &world, hittable_list &lights, const render_pass& pass, int id){
+    // Tiles are walked in square blocks of pixels whose camera rays form one packet,
+    // single pixels when packets are off.
+    const int block = img.packet_size > 1 ? img.packet_size : 1;
+    ray_packet packet;
+    int pixels[ray_packet::max_size];
+    int first_sample[ray_packet::max_size];
+    int sample_count[ray_packet::max_size];
+
+    std::unique_ptr<wavefront_batch> wavefront;
+    if (img.wavefront) wavefront = std::make_unique<wavefront_batch>();
+
+    tile t;
+    while (std::chrono::steady_clock::now() < pass.deadline && scheduler.next_tile(id, t)){
+        if (wavefront){
+            trace_tile_wavefront(*wavefront, accumulation, img, cam, world, lights, t, pass);
             if (LIVE_WINDOW_RENDER){
-                mtx.lock();
-                COLORREF win_color = RGB(image_buffer[pixel * 3], image_buffer[pixel * 3 + 1], image_buffer[pixel * 3 + 2]);
-                // Set the color of the pixel at the specified coordinates
-                SetPixel(globalHDC, j, i, win_color);
-                //pixel++;
-                mtx.unlock();
+                for (int i = t.y0; i < t.y1; i++)
+                    for (int j = t.x0; j < t.x1; j++)
+                        show_live_pixel(accumulation, image_buffer, img, i * img.image_width + j);
+            }
+        }else{
+            for (int by = t.y0; by < t.y1; by += block){
+                for (int bx = t.x0; bx < t.x1; bx += block){
+                    int pixel_count = 0;
+                    int rounds = 0;
+                    for (int i = by; i < std::min(by + block, t.y1); i++){
+                        for (int j = bx; j < std::min(bx + block, t.x1); j++){
+                            //Buffer Coordinate
+                            int pixel = i * img.image_width + j;
+
+                            pixels[pixel_count] = pixel;
+                            sample_count[pixel_count] = pass_samples(accumulation, img, pass, pixel, first_sample[pixel_count]);
+                            rounds = std::max(rounds, sample_count[pixel_count]);
+                            pixel_count++;
+                        }
+                    }
+
+                    for (int round = 0; round < rounds; round++){
+                        if (block > 1){
+                            trace_packet(packet, accumulation, img, cam, world, lights, round, pixel_count, pixels, first_sample, sample_count);
+                            continue;
+                        }
+                        ray r = camera_ray(img, cam, pixels[0], first_sample[0] + round);
+                        accumulation.add_sample(pixels[0], ray_color(r, img.background_color, world, lights, img.max_depth, img.rr_start_depth));
+                    }
+
+                    if (LIVE_WINDOW_RENDER && rounds > 0){
+                        for (int k = 0; k < pixel_count; k++)
+                            show_live_pixel(accumulation, image_buffer, img, pixels[k]);
+                    }
+                }
             }
         }
 
-        if (i % (id + 1) != 0) continue;
+        scheduler.tile_done();
 
-        finish_percentage[id] = (float)(i - start) / (float)(end - start);
-        float median = 0;
-        for(int i = 0; i < finish_percentage.size(); i++)
-        {
-            median += finish_percentage[i];
-        }
-        median /= finish_percentage.size();
-        median *= 100;
+        float pass_done = float(scheduler.tiles_finished()) / scheduler.tile_count();
+        float percentage = 100.0f * (pass.first_sample + pass_done * pass.sample_count) / img.samples_per_pixel;
         mtx.lock();
         std::cout << "\r                         " << std::flush;
-        std::cout << "\rRendering: "<< std::setprecision(5) << median << "%" << std::flush;
+        std::cout << "\rRendering: "<< std::setprecision(5) << percentage << "%" << std::flush;
         mtx.unlock();
     }
+
+    traversal_stats::flush_thread();
 }
 #pragma endregion
 
@@ -964,6 +1602,33 @@ int main(int argc, char** argv){
                 img.samples_per_pixel = std::stoi(line.substr(line.find('=') + 1));
             }else if (line.find("max_depth") != std::string::npos){
                 img.max_depth = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("integrator") != std::string::npos){
+                std::stringstream ss(line.substr(line.find('=') + 1));
+                std::string integrator;
+                ss >> std::ws >> integrator;
+                img.wavefront = integrator == "wavefront";
+            }else if (line.find("packet_size") != std::string::npos){
+                img.packet_size = std::min(std::stoi(line.substr(line.find('=') + 1)), 8);
+            }else if (line.find("samples_per_pass") != std::string::npos){
+                img.samples_per_pass = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("time_budget") != std::string::npos){
+                img.time_budget = std::stod(line.substr(line.find('=') + 1));
+            }else if (line.find("adaptive_sampling") != std::string::npos){
+                img.adaptive.enabled = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("adaptive_threshold") != std::string::npos){
+                img.adaptive.threshold = std::stod(line.substr(line.find('=') + 1));
+            }else if (line.find("min_spp") != std::string::npos){
+                img.adaptive.min_spp = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("max_spp") != std::string::npos){
+                img.adaptive.max_spp = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("sample_heatmap") != std::string::npos){
+                img.sample_heatmap = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("rr_start_depth") != std::string::npos){
+                img.rr_start_depth = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("light_sampling") != std::string::npos){
+                img.light_sampling = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("tile_size") != std::string::npos){
+                img.tile_size = std::stoi(line.substr(line.find('=') + 1));
             }else if (line.find("LIVE_WINDOW_RENDER") != std::string::npos){
                 LIVE_WINDOW_RENDER = std::stoi(line.substr(line.find('=') + 1));
             }else if (line.find("scene_name") != std::string::npos){
@@ -980,6 +1645,36 @@ int main(int argc, char** argv){
             }else if (line.find("CONSOLE_DEBUG") != std::string::npos){
                 std::stringstream ss(line.substr(line.find('=') + 1));
                 ss >> CONSOLE_DEBUG;
+            }else if (line.find("render_threads") != std::string::npos){
+                RENDER_THREADS = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("bvh_builder") != std::string::npos){
+                std::stringstream ss(line.substr(line.find('=') + 1));
+                std::string builder;
+                ss >> std::ws >> builder;
+                BVH_SPLIT = builder == "random" ? bvh_split::random_axis : bvh_split::sah;
+                BUILD_ACCELERATOR = builder != "none";
+            }else if (line.find("bvh_width") != std::string::npos){
+                BVH_WIDTH = std::stoi(line.substr(line.find('=') + 1)) == 2 ? 2 : 4;
+            }else if (line.find("sphere_leaf_size") != std::string::npos){
+                SPHERE_LEAF_SIZE = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("box_leaf_size") != std::string::npos){
+                BOX_LEAF_SIZE = std::stoi(line.substr(line.find('=') + 1));
+            }else if (line.find("simd") != std::string::npos){
+                std::stringstream ss(line.substr(line.find('=') + 1));
+                std::string level;
+                ss >> std::ws >> level;
+                cpu_features::limit(cpu_features::parse(level));
+            }else if (line.find("sampler") != std::string::npos){
+                std::stringstream ss(line.substr(line.find('=') + 1));
+                std::string sequence;
+                ss >> std::ws >> sequence;
+                sampler::sequence = sequence == "sobol" ? sample_sequence::sobol
+                    : sequence == "blue_noise" ? sample_sequence::blue_noise : sample_sequence::independent;
+                if (sampler::sequence == sample_sequence::blue_noise)
+                    blue_noise_mask::get(); // generate the mask before the render threads start
+            }else if (line.find("seed") != std::string::npos){
+                std::stringstream ss(line.substr(line.find('=') + 1));
+                ss >> sampler::seed;
             }
         }
         configFile.close();
@@ -994,6 +1689,9 @@ int main(int argc, char** argv){
         return 1;
     }
 
+    hittable_list accelerated_world = build_world_accelerator(world);
+    hittable_list lights = img.light_sampling ? collect_lights(world) : hittable_list();
+
     if (WaitForUserInput_Start() > 0) return 1;
     if (CONSOLE_DEBUG){
         std::cout << "Image configuration:" << std::endl;
@@ -1002,7 +1700,7 @@ int main(int argc, char** argv){
         std::cout << "Scene: " << scene_name << std::endl;
     }
 
-    Render(cam, img, world);
+    Render(cam, img, accelerated_world, lights);
 
     MSG msg;
     while (GetMessage(&msg, nullptr, 0, 0)){
@@ -1015,7 +1713,7 @@ int main(int argc, char** argv){
     return 0;
 }
 
-void Render(camera &cam, image &img, hittable_list &world){
+void Render(camera &cam, image &img, hittable_list &world, hittable_list &lights){
     #pragma region Create Window
     if (LIVE_WINDOW_RENDER)
     {
@@ -1030,32 +1728,78 @@ void Render(camera &cam, image &img, hittable_list &world){
 
     //Image buffer / data
     std::vector<unsigned char> image(img.image_width * img.image_height * 3);
+    film accumulation(img.image_width, img.image_height);
 
     auto start_time = std::chrono::high_resolution_clock::now();
 
     #pragma region MultiThread
-    const int numThreads = std::thread::hardware_concurrency() - 1;
-    std::vector<std::thread> threads;
-    std::vector<float> percentages(numThreads);
+    const int numThreads = RENDER_THREADS > 0 ? RENDER_THREADS : std::max(1u, std::thread::hardware_concurrency());
 
-    // Calculate the workload for each thread
-    int workload = img.image_height / numThreads;
-    int start = 0;
-    int end = 0;
+    // Progressive mode renders samples_per_pass samples at a time until samples_per_pixel
+    // is reached or the time budget runs out, whichever comes first.
+    // Adaptive mode spends the same total budget, but only on pixels that are still noisy.
+    adaptive_settings& adaptive = img.adaptive;
+    if (adaptive.max_spp <= 0) adaptive.max_spp = 4 * img.samples_per_pixel;
 
-    // Create and launch the threads
-    for (int i = 0; i < numThreads; i++){
-        start = i * workload;
-        end = (i == numThreads - 1) ? img.image_height : (i + 1) * workload;
+    int pass_samples = img.samples_per_pass > 0 ? img.samples_per_pass
+        : (img.time_budget > 0 || adaptive.enabled) ? 8 : img.samples_per_pixel;
+    bool progressive = pass_samples < img.samples_per_pixel || adaptive.enabled;
+    const long long sample_budget = static_cast<long long>(img.samples_per_pixel) * img.image_width * img.image_height;
 
-        threads.emplace_back(ThreadRender, start, end, std::ref(image), std::ref(img), std::ref(cam), std::ref(world), std::ref(percentages), i);
-    }
+    auto pixel_active = [&](int pixel) {
+        return adaptive.samples_wanted(accumulation, pixel, pass_samples) > 0;
+    };
+    auto tile_active = [&](const tile& t) {
+        for (int i = t.y0; i < t.y1; i++)
+            for (int j = t.x0; j < t.x1; j++)
+                if (pixel_active(i * img.image_width + j)) return true;
+        return false;
+    };
+
+    render_pass pass;
+    pass.deadline = img.time_budget > 0
+        ? std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(img.time_budget))
+        : std::chrono::steady_clock::time_point::max();
+
+    for (pass.first_sample = 0; ; pass.first_sample += pass.sample_count){
+        if (std::chrono::steady_clock::now() >= pass.deadline) break;
+
+        if (adaptive.enabled){
+            if (accumulation.total_samples() >= sample_budget) break;
+            pass.sample_count = pass_samples;
+        }else{
+            if (pass.first_sample >= img.samples_per_pixel) break;
+            pass.sample_count = std::min(pass_samples, img.samples_per_pixel - pass.first_sample);
+        }
+
+        // Tiles are handed out on demand, so cheap sky tiles and expensive glass tiles balance out.
+        // Converged tiles are not scheduled at all.
+        tile_scheduler scheduler(img.image_width, img.image_height, numThreads, img.tile_size,
+            adaptive.enabled ? std::function<bool(const tile&)>(tile_active) : nullptr);
+        if (scheduler.tile_count() == 0) break;
 
-    // Wait for all threads to finish
-    for (std::thread& t : threads){
-        t.join();
+        std::vector<std::thread> threads;
+
+        // Create and launch the threads
+        for (int i = 0; i < numThreads; i++){
+            threads.emplace_back(ThreadRender, std::ref(scheduler), std::ref(accumulation), std::ref(image), std::ref(img), std::ref(cam), std::ref(world), std::ref(lights), std::cref(pass), i);
+        }
+
+        // Wait for all threads to finish
+        for (std::thread& t : threads){
+            t.join();
+        }
+
+        if (progressive){
+            // Publish the current estimate
+            accumulation.develop(image);
+            if (LIVE_WINDOW_RENDER) DrawBufferToWindow(globalHWND, globalHDC, img.image_width, img.image_height, image);
+            DataToPng(img.pngImg, img.image_width, img.image_height, image, false);
+        }
     }
 
+    accumulation.develop(image);
+
     #pragma endregion
 
     auto end_time = std::chrono::high_resolution_clock::now();
@@ -1066,6 +1810,15 @@ void Render(camera &cam, image &img, hittable_list &world){
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end_time - start_time).count() / 1000.0;
     // Display the time taken
     std::cout << "\nTime taken: " << duration << " seconds" << std::endl;
+    if (progressive){
+        std::cout << "Samples per pixel: " << accumulation.average_samples() << " / " << img.samples_per_pixel << std::endl;
+    }
+    if (img.sample_heatmap){
+        WriteSampleHeatmap(img.heatmapImg, accumulation);
+    }
+    if (CONSOLE_DEBUG && traversal_stats::enabled){
+        std::cout << "BVH node visits per ray: " << traversal_stats::node_visits_per_ray() << std::endl;
+    }
 
     DrawBufferToWindow(globalHWND, globalHDC, img.image_width, img.image_height, image);
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <algorithm>
+
 #include "ray_trace_engine.h"
 
 class aabb {
@@ -10,20 +12,22 @@ public:
     point3 minim() const { return minimum; }
     point3 maxim() const { return maximum; }
 
+    // Slab test with the ray's cached reciprocal direction: the near and far planes are
+    // picked from the direction signs, so there are no divisions and no branches. The
+    // comparisons keep the running interval when a plane distance is NaN (a ray parallel
+    // to a slab, starting on one of its planes), which then counts as inside that slab.
     bool hit(const ray& r, double t_min, double t_max) const
     {
+        const vector3& inv_dir = r.inverse_direction();
         for (int a = 0; a < 3; a++)
         {
-            auto t0 = fmin((minimum[a] - r.origin()[a]) / r.direction()[a],
-                (maximum[a] - r.origin()[a]) / r.direction()[a]);
-            auto t1 = fmax((minimum[a] - r.origin()[a]) / r.direction()[a],
-                (maximum[a] - r.origin()[a]) / r.direction()[a]);
-            t_min = fmax(t0, t_min);
-            t_max = fmin(t1, t_max);
-            if (t_max <= t_min)
-                return false;
+            int sign = r.direction_sign(a);
+            double t0 = ((sign ? maximum : minimum)[a] - r.origin()[a]) * inv_dir[a];
+            double t1 = ((sign ? minimum : maximum)[a] - r.origin()[a]) * inv_dir[a];
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
         }
-        return true;
+        return t_min < t_max;
     }
 
     double area() const
@@ -52,11 +56,13 @@ public:
     point3 maximum;
 };
 
-inline aabb surrounding_box(aabb box0, aabb box1)
+inline aabb surrounding_box(const aabb& box0, const aabb& box1)
 {
-    vector3 smol( fmin(box0.minim().x(), box1.minim().x()), fmin(box0.minim().y(), box1.minim().y()), fmin(box0.minim().z(), box1.minim().z()));
+    // std::min / std::max compile to single instructions, fmin / fmax are library calls
+    // that also handle NaN, which bounds never contain.
+    vector3 smol(std::min(box0.minimum.x(), box1.minimum.x()), std::min(box0.minimum.y(), box1.minimum.y()), std::min(box0.minimum.z(), box1.minimum.z()));
 
-    vector3 big(   fmax(box0.maxim().x(), box1.maxim().x()), fmax(box0.maxim().y(), box1.maxim().y()), fmax(box0.maxim().z(), box1.maxim().z()));
+    vector3 big(std::max(box0.maximum.x(), box1.maximum.x()), std::max(box0.maximum.y(), box1.maximum.y()), std::max(box0.maximum.z(), box1.maximum.z()));
 
     return aabb(smol, big);
 }
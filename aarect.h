@@ -2,6 +2,7 @@
 
 #include "ray_trace_engine.h"
 #include "hittable.h"
+#include "material.h"
 
 class xy_rect : public hittable {
 public:
@@ -9,11 +10,13 @@ public:
 
     xy_rect(double _x0, double _x1, double _y0, double _y1, double _k,
         shared_ptr<material> mat)
-        : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat)
+        : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(scene_materials.add(mat))
     {
     };
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -23,27 +26,46 @@ public:
         return true;
     }
 
+    virtual double pdf_value(const point3& origin, const vector3& v) const override;
+    virtual vector3 random(const point3& origin) const override;
+    virtual bool is_light() const override { return scene_materials[mp] && scene_materials[mp]->is_emissive(); }
+
 public:
-    shared_ptr<material> mp;
-    double x0, x1, y0, y1, k;
+    material_handle mp = handle_table<material>::none;
+    real x0, x1, y0, y1, k;
 };
 
 inline bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const{
-    auto t = (k - r.origin().z()) / r.direction().z();
+    auto t = (k - r.origin().z()) * r.inverse_direction().z();
     if (t < t_min || t > t_max)
         return false;
     auto x = r.origin().x() + t * r.direction().x();
     auto y = r.origin().y() + t * r.direction().y();
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
     rec.t = t;
+    rec.prim = this;
+    return true;
+}
+
+inline void xy_rect::finalize(const ray& r, hit_record& rec) const
+{
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.y() - y0) / (y1 - y0);
     auto outward_normal = vector3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat = mp;
+}
+
+inline bool xy_rect::occluded(const ray& r, double t_min, double t_max) const
+{
+    auto t = (k - r.origin().z()) * r.inverse_direction().z();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto y = r.origin().y() + t * r.direction().y();
+    return x >= x0 && x <= x1 && y >= y0 && y <= y1;
 }
 
 class xz_rect : public hittable {
@@ -52,11 +74,13 @@ public:
 
     xz_rect(double _x0, double _x1, double _z0, double _z1, double _k,
         shared_ptr<material> mat)
-        : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat)
+        : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(scene_materials.add(mat))
     {
     };
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -66,9 +90,13 @@ public:
         return true;
     }
 
+    virtual double pdf_value(const point3& origin, const vector3& v) const override;
+    virtual vector3 random(const point3& origin) const override;
+    virtual bool is_light() const override { return scene_materials[mp] && scene_materials[mp]->is_emissive(); }
+
 public:
-    shared_ptr<material> mp;
-    double x0, x1, z0, z1, k;
+    material_handle mp = handle_table<material>::none;
+    real x0, x1, z0, z1, k;
 };
 
 class yz_rect : public hittable {
@@ -77,11 +105,13 @@ public:
 
     yz_rect(double _y0, double _y1, double _z0, double _z1, double _k,
         shared_ptr<material> mat)
-        : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat)
+        : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(scene_materials.add(mat))
     {
     };
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -91,45 +121,142 @@ public:
         return true;
     }
 
+    virtual double pdf_value(const point3& origin, const vector3& v) const override;
+    virtual vector3 random(const point3& origin) const override;
+    virtual bool is_light() const override { return scene_materials[mp] && scene_materials[mp]->is_emissive(); }
+
 public:
-    shared_ptr<material> mp;
-    double y0, y1, z0, z1, k;
+    material_handle mp = handle_table<material>::none;
+    real y0, y1, z0, z1, k;
 };
 
 inline bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-    auto t = (k - r.origin().y()) / r.direction().y();
+    auto t = (k - r.origin().y()) * r.inverse_direction().y();
     if (t < t_min || t > t_max)
         return false;
     auto x = r.origin().x() + t * r.direction().x();
     auto z = r.origin().z() + t * r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
+    rec.prim = this;
+    return true;
+}
+
+inline void xz_rect::finalize(const ray& r, hit_record& rec) const
+{
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vector3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat = mp;
+}
+
+inline bool xz_rect::occluded(const ray& r, double t_min, double t_max) const
+{
+    auto t = (k - r.origin().y()) * r.inverse_direction().y();
+    if (t < t_min || t > t_max)
+        return false;
+    auto x = r.origin().x() + t * r.direction().x();
+    auto z = r.origin().z() + t * r.direction().z();
+    return x >= x0 && x <= x1 && z >= z0 && z <= z1;
 }
 
 inline bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-    auto t = (k - r.origin().x()) / r.direction().x();
+    auto t = (k - r.origin().x()) * r.inverse_direction().x();
     if (t < t_min || t > t_max)
         return false;
     auto y = r.origin().y() + t * r.direction().y();
     auto z = r.origin().z() + t * r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
-    rec.u = (y - y0) / (y1 - y0);
-    rec.v = (z - z0) / (z1 - z0);
     rec.t = t;
+    rec.prim = this;
+    return true;
+}
+
+inline void yz_rect::finalize(const ray& r, hit_record& rec) const
+{
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.y() - y0) / (y1 - y0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vector3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat = mp;
+}
+
+inline bool yz_rect::occluded(const ray& r, double t_min, double t_max) const
+{
+    auto t = (k - r.origin().x()) * r.inverse_direction().x();
+    if (t < t_min || t > t_max)
+        return false;
+    auto y = r.origin().y() + t * r.direction().y();
+    auto z = r.origin().z() + t * r.direction().z();
+    return y >= y0 && y <= y1 && z >= z0 && z <= z1;
+}
+
+inline double xy_rect::pdf_value(const point3& origin, const vector3& v) const
+{
+    hit_record rec;
+    ray probe(origin, v);
+    if (!this->hit(probe, surface_t_min(probe), infinity, rec))
+        return 0;
+
+    // Uniform over the area, converted to solid angle.
+    auto area = (x1 - x0) * (y1 - y0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(v.z() / v.length());
+
+    return distance_squared / (cosine * area);
+}
+
+inline vector3 xy_rect::random(const point3& origin) const
+{
+    auto random_point = point3(random_double(x0, x1), random_double(y0, y1), k);
+    return random_point - origin;
+}
+
+inline double xz_rect::pdf_value(const point3& origin, const vector3& v) const
+{
+    hit_record rec;
+    ray probe(origin, v);
+    if (!this->hit(probe, surface_t_min(probe), infinity, rec))
+        return 0;
+
+    // Uniform over the area, converted to solid angle.
+    auto area = (x1 - x0) * (z1 - z0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(v.y() / v.length());
+
+    return distance_squared / (cosine * area);
+}
+
+inline vector3 xz_rect::random(const point3& origin) const
+{
+    auto random_point = point3(random_double(x0, x1), k, random_double(z0, z1));
+    return random_point - origin;
+}
+
+inline double yz_rect::pdf_value(const point3& origin, const vector3& v) const
+{
+    hit_record rec;
+    ray probe(origin, v);
+    if (!this->hit(probe, surface_t_min(probe), infinity, rec))
+        return 0;
+
+    // Uniform over the area, converted to solid angle.
+    auto area = (y1 - y0) * (z1 - z0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(v.x() / v.length());
+
+    return distance_squared / (cosine * area);
+}
+
+inline vector3 yz_rect::random(const point3& origin) const
+{
+    auto random_point = point3(k, random_double(y0, y1), random_double(z0, z1));
+    return random_point - origin;
 }
\ No newline at end of file
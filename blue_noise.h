@@ -0,0 +1,119 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Tileable blue noise threshold mask, made with Ulichney's void and cluster method: every
+// value in [0, 1) appears once, and each set of the lowest values is spread out as evenly
+// as possible. Offsetting the samples of neighbouring pixels by it moves their error into
+// high frequencies, which reads as much finer grain at low sample counts.
+// Generated on first use (a few tens of milliseconds), then shared read only.
+class blue_noise_mask {
+public:
+    static constexpr int size = 64;
+
+    static const blue_noise_mask& get()
+    {
+        static const blue_noise_mask mask;
+        return mask;
+    }
+
+    // Tiles the plane. 32 bit fixed point, so adding it to another fixed point value in
+    // [0, 1) wraps around by itself.
+    uint32_t value(uint32_t x, uint32_t y) const
+    {
+        return values[(y % size) * size + x % size];
+    }
+
+private:
+    blue_noise_mask()
+    {
+        const int n = size * size;
+
+        // Toroidal Gaussian splat, indexed by the wrapped offset between two cells.
+        const double sigma = 1.5;
+        std::vector<double> splat(n);
+        for (int dy = 0; dy < size; dy++)
+        {
+            for (int dx = 0; dx < size; dx++)
+            {
+                int wx = std::min(dx, size - dx), wy = std::min(dy, size - dy);
+                splat[dy * size + dx] = exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+            }
+        }
+
+        std::vector<bool> on(n, false);
+        std::vector<double> energy(n, 0.0);
+        auto toggle = [&](int p, bool set) {
+            on[p] = set;
+            int px = p % size, py = p / size;
+            double sign = set ? 1 : -1;
+            for (int qy = 0; qy < size; qy++)
+            {
+                const double* row = &splat[((qy - py) & (size - 1)) * size];
+                for (int qx = 0; qx < size; qx++)
+                    energy[qy * size + qx] += sign * row[(qx - px) & (size - 1)];
+            }
+        };
+        // The set cell in the densest cluster, or the free cell in the largest void.
+        auto extreme = [&](bool set) {
+            int best = -1;
+            for (int p = 0; p < n; p++)
+                if (on[p] == set && (best < 0 || (set ? energy[p] > energy[best] : energy[p] < energy[best])))
+                    best = p;
+            return best;
+        };
+
+        // A random tenth of the cells, then relaxed by moving the densest point into the
+        // largest void until that puts it back where it was.
+        uint64_t state = 0x2545f4914f6cdd1dull;
+        int initial = n / 10;
+        for (int placed = 0; placed < initial;)
+        {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            int p = static_cast<int>((state >> 33) % n);
+            if (!on[p]) { toggle(p, true); placed++; }
+        }
+        for (int iteration = 0; iteration < n; iteration++)
+        {
+            int cluster = extreme(true);
+            toggle(cluster, false);
+            int void_cell = extreme(false);
+            toggle(void_cell, true);
+            if (void_cell == cluster)
+                break;
+        }
+
+        std::vector<int> rank(n);
+        std::vector<bool> initial_on = on;
+        std::vector<double> initial_energy = energy;
+
+        // Ranks below the initial count: take points out from the densest cluster down.
+        for (int r = initial - 1; r >= 0; r--)
+        {
+            int cluster = extreme(true);
+            toggle(cluster, false);
+            rank[cluster] = r;
+        }
+
+        // The rest: fill the largest void each time. Past half full this is the same as
+        // removing the densest cluster of empty cells, the usual third phase.
+        on = initial_on;
+        energy = initial_energy;
+        for (int r = initial; r < n; r++)
+        {
+            int void_cell = extreme(false);
+            toggle(void_cell, true);
+            rank[void_cell] = r;
+        }
+
+        // (rank + 0.5) / n, in units of 2^-32.
+        values.resize(n);
+        for (int p = 0; p < n; p++)
+            values[p] = static_cast<uint32_t>(((2 * static_cast<uint64_t>(rank[p]) + 1) << 31) / n);
+    }
+
+    std::vector<uint32_t> values;
+};
@@ -1,15 +1,41 @@
 #pragma once
 
-#include "aarect.h"
-#include "hittable_list.h"
+#include <cmath>
+
 #include "ray_trace_engine.h"
+#include "hittable.h"
+#include "material.h"
 
+// An axis aligned box, intersected with one slab test. hit() only records the distance;
+// finalize() works out which face was hit and takes the normal and uv from its axis.
 class box : public hittable {
 public:
     box() {}
-    box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
+    box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+        : box_min(p0), box_max(p1), mp(scene_materials.add(ptr))
+    {
+    }
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+    {
+        double t;
+        if (!intersect(box_min, box_max, r, t_min, t_max, t))
+            return false;
+        rec.t = t;
+        rec.prim = this;
+        return true;
+    }
+
+    virtual void finalize(const ray& r, hit_record& rec) const override
+    {
+        resolve(box_min, box_max, mp, r, rec);
+    }
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        double t;
+        return intersect(box_min, box_max, r, t_min, t_max, t);
+    }
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
     {
@@ -17,28 +43,63 @@ public:
         return true;
     }
 
-public:
-    point3 box_min;
-    point3 box_max;
-    hittable_list sides;
-};
-
-inline box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
-{
-    box_min = p0;
-    box_max = p1;
+    // Slab test of the box [lo, hi]: the entry distance, or the exit distance when the ray
+    // starts inside (so media bounded by a box find both walls), if it is in [t_min, t_max].
+    // Comparisons are ordered so the NaN of a ray parallel to a face, starting on its
+    // plane, leaves the interval alone.
+    static bool intersect(const point3& lo, const point3& hi, const ray& r, double t_min, double t_max, double& t)
+    {
+        double t_near = -infinity, t_far = infinity;
+        for (int a = 0; a < 3; a++)
+        {
+            int sign = r.direction_sign(a);
+            double t0 = ((sign ? hi : lo)[a] - r.origin()[a]) * r.inverse_direction()[a];
+            double t1 = ((sign ? lo : hi)[a] - r.origin()[a]) * r.inverse_direction()[a];
+            t_near = t0 > t_near ? t0 : t_near;
+            t_far = t1 < t_far ? t1 : t_far;
+        }
+        if (t_near > t_far)
+            return false;
+        t = t_near >= t_min ? t_near : t_far;
+        return t >= t_min && t <= t_max;
+    }
 
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+    // Fills in a hit on the box [lo, hi] at rec.t. The face is the one whose plane lies
+    // closest to the hit distance; u and v run along its other two axes, in axis order, as
+    // they did on the rectangles boxes used to be made of.
+    static void resolve(const point3& lo, const point3& hi, material_handle mat, const ray& r, hit_record& rec)
+    {
+        int axis = 0;
+        bool upper = false;
+        double best = infinity;
+        for (int a = 0; a < 3; a++)
+        {
+            for (int side = 0; side < 2; side++)
+            {
+                double distance = fabs(((side ? hi[a] : lo[a]) - r.origin()[a]) * r.inverse_direction()[a] - rec.t);
+                if (distance < best)
+                {
+                    best = distance;
+                    axis = a;
+                    upper = side;
+                }
+            }
+        }
 
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
+        rec.p = r.at(rec.t);
+        int u_axis = axis == 0 ? 1 : 0;
+        int v_axis = axis == 2 ? 1 : 2;
+        rec.u = (rec.p[u_axis] - lo[u_axis]) / (hi[u_axis] - lo[u_axis]);
+        rec.v = (rec.p[v_axis] - lo[v_axis]) / (hi[v_axis] - lo[v_axis]);
 
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
-}
+        vector3 outward_normal(0, 0, 0);
+        outward_normal[axis] = upper ? 1 : -1;
+        rec.set_face_normal(r, outward_normal);
+        rec.mat = mat;
+    }
 
-inline bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-    return sides.hit(r, t_min, t_max, rec);
-}
+public:
+    point3 box_min;
+    point3 box_max;
+    material_handle mp = handle_table<material>::none;
+};
@@ -0,0 +1,311 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <typeinfo>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "hittable.h"
+#include "material.h"
+#include "box.h"
+#include "bvh.h"
+#include "cpu_features.h"
+
+// Many axis aligned boxes in structure of arrays form, slab tested several at a time with
+// SSE2 / AVX2 / AVX-512 like sphere_set does for spheres. The kernels make the same
+// comparisons as box::intersect, in doubles, so a packed box hits exactly where a lone one
+// would. The flattened BVHs pack small subtrees of boxes into one of these as a single leaf.
+class box_set : public hittable {
+public:
+    // Padding lanes hold empty boxes (min +inf, max -inf), which no ray enters.
+    static constexpr int lane_padding = 8;
+
+    box_set() {}
+
+    void add(const point3& lo, const point3& hi, material_handle mat)
+    {
+        size_t i = count++;
+        if (i == materials.size())
+        {
+            size_t padded = materials.size() + lane_padding;
+            for (int a = 0; a < 3; a++)
+            {
+                lows[a].resize(padded, infinity);
+                highs[a].resize(padded, -infinity);
+            }
+            materials.resize(padded, handle_table<material>::none);
+        }
+
+        for (int a = 0; a < 3; a++)
+        {
+            lows[a][i] = lo[a];
+            highs[a][i] = hi[a];
+        }
+        materials[i] = mat;
+
+        box = i == 0 ? aabb(lo, hi) : surrounding_box(box, aabb(lo, hi));
+    }
+
+    void add(const ::box& b) { add(b.box_min, b.box_max, b.mp); }
+
+    size_t size() const { return count; }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+    {
+        int index = intersect(r, t_min, t_max, false);
+        if (index < 0)
+            return false;
+
+        rec.t = t_max;
+        rec.prim = this;
+        rec.prim_index = index;
+        return true;
+    }
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        return intersect(r, t_min, t_max, true) >= 0;
+    }
+
+    virtual void finalize(const ray& r, hit_record& rec) const override
+    {
+        int i = rec.prim_index;
+        ::box::resolve(low(i), high(i), materials[i], r, rec);
+    }
+
+    virtual bool bounding_box(double, double, aabb& output_box) const override
+    {
+        output_box = box;
+        return count > 0;
+    }
+
+    // Index of the closest box hit in [t_min, t_max] (any box if any_hit), with t_max
+    // moved to its distance, or -1.
+    int intersect(const ray& r, double t_min, double& t_max, bool any_hit) const
+    {
+        switch (cpu_features::level)
+        {
+#ifdef RT_X86_64
+        case simd_level::avx512: return intersect_avx512(r, t_min, t_max, any_hit);
+        case simd_level::avx2: return intersect_avx2(r, t_min, t_max, any_hit);
+        case simd_level::sse2: return intersect_sse2(r, t_min, t_max, any_hit);
+#endif
+        default: return intersect_scalar(r, t_min, t_max, any_hit);
+        }
+    }
+
+public:
+    std::vector<double> lows[3], highs[3]; // per axis
+    std::vector<material_handle> materials;
+    size_t count = 0;
+    aabb box;
+
+private:
+    point3 low(size_t i) const { return point3(lows[0][i], lows[1][i], lows[2][i]); }
+    point3 high(size_t i) const { return point3(highs[0][i], highs[1][i], highs[2][i]); }
+
+    // The planes each axis of the ray enters and leaves the boxes through.
+    struct slab_planes {
+        const double* near_planes[3];
+        const double* far_planes[3];
+        double inv_d[3];
+    };
+
+    slab_planes planes(const ray& r) const
+    {
+        slab_planes s;
+        for (int a = 0; a < 3; a++)
+        {
+            s.inv_d[a] = r.inverse_direction()[a];
+            s.near_planes[a] = (r.direction_sign(a) ? highs[a] : lows[a]).data();
+            s.far_planes[a] = (r.direction_sign(a) ? lows[a] : highs[a]).data();
+        }
+        return s;
+    }
+
+    int intersect_scalar(const ray& r, double t_min, double& t_max, bool any_hit) const;
+#ifdef RT_X86_64
+    int intersect_sse2(const ray& r, double t_min, double& t_max, bool any_hit) const;
+    RT_TARGET_AVX2 int intersect_avx2(const ray& r, double t_min, double& t_max, bool any_hit) const;
+    RT_TARGET_AVX512 int intersect_avx512(const ray& r, double t_min, double& t_max, bool any_hit) const;
+#endif
+
+    // Lanes are taken in order and ties go to the later box, as in intersect_scalar, so
+    // every kernel picks the same box.
+    bool closer_lanes(int mask, const double* t, size_t first, int lanes, double& t_max, int& best, bool any_hit) const
+    {
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            if ((mask >> lane & 1) && t[lane] <= t_max)
+            {
+                t_max = t[lane];
+                best = static_cast<int>(first + lane);
+                if (any_hit) return true;
+            }
+        }
+        return false;
+    }
+};
+
+inline int box_set::intersect_scalar(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    int best = -1;
+    for (size_t i = 0; i < count; i++)
+    {
+        double t;
+        if (::box::intersect(low(i), high(i), r, t_min, t_max, t))
+        {
+            t_max = t;
+            best = static_cast<int>(i);
+            if (any_hit) break;
+        }
+    }
+    return best;
+}
+
+#ifdef RT_X86_64
+inline int box_set::intersect_sse2(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    const slab_planes s = planes(r);
+    __m128d o[3], inv_d[3];
+    for (int a = 0; a < 3; a++)
+    {
+        o[a] = _mm_set1_pd(r.origin()[a]);
+        inv_d[a] = _mm_set1_pd(s.inv_d[a]);
+    }
+    const __m128d tmin = _mm_set1_pd(t_min);
+    alignas(16) double t[2];
+    int best = -1;
+
+    for (size_t i = 0; i < count; i += 2)
+    {
+        // max / min return their second operand on NaN, which keeps the running interval.
+        __m128d t_near = _mm_set1_pd(-infinity), t_far = _mm_set1_pd(infinity);
+        for (int a = 0; a < 3; a++)
+        {
+            t_near = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(s.near_planes[a] + i), o[a]), inv_d[a]), t_near);
+            t_far = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(_mm_loadu_pd(s.far_planes[a] + i), o[a]), inv_d[a]), t_far);
+        }
+        __m128d valid = _mm_cmple_pd(t_near, t_far);
+        if (_mm_movemask_pd(valid) == 0) continue;
+
+        __m128d use_near = _mm_cmpge_pd(t_near, tmin);
+        __m128d root = _mm_or_pd(_mm_and_pd(use_near, t_near), _mm_andnot_pd(use_near, t_far));
+        __m128d in = _mm_and_pd(_mm_cmpge_pd(root, tmin), _mm_cmple_pd(root, _mm_set1_pd(t_max)));
+        int mask = _mm_movemask_pd(_mm_and_pd(valid, in));
+        if (mask == 0) continue;
+
+        _mm_store_pd(t, root);
+        if (closer_lanes(mask, t, i, 2, t_max, best, any_hit)) break;
+    }
+    return best;
+}
+
+RT_TARGET_AVX2 inline int box_set::intersect_avx2(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    const slab_planes s = planes(r);
+    __m256d o[3], inv_d[3];
+    for (int a = 0; a < 3; a++)
+    {
+        o[a] = _mm256_set1_pd(r.origin()[a]);
+        inv_d[a] = _mm256_set1_pd(s.inv_d[a]);
+    }
+    const __m256d tmin = _mm256_set1_pd(t_min);
+    alignas(32) double t[4];
+    int best = -1;
+
+    for (size_t i = 0; i < count; i += 4)
+    {
+        __m256d t_near = _mm256_set1_pd(-infinity), t_far = _mm256_set1_pd(infinity);
+        for (int a = 0; a < 3; a++)
+        {
+            t_near = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(s.near_planes[a] + i), o[a]), inv_d[a]), t_near);
+            t_far = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(s.far_planes[a] + i), o[a]), inv_d[a]), t_far);
+        }
+        __m256d valid = _mm256_cmp_pd(t_near, t_far, _CMP_LE_OQ);
+        if (_mm256_movemask_pd(valid) == 0) continue;
+
+        __m256d root = _mm256_blendv_pd(t_far, t_near, _mm256_cmp_pd(t_near, tmin, _CMP_GE_OQ));
+        __m256d in = _mm256_and_pd(_mm256_cmp_pd(root, tmin, _CMP_GE_OQ), _mm256_cmp_pd(root, _mm256_set1_pd(t_max), _CMP_LE_OQ));
+        int mask = _mm256_movemask_pd(_mm256_and_pd(valid, in));
+        if (mask == 0) continue;
+
+        _mm256_store_pd(t, root);
+        if (closer_lanes(mask, t, i, 4, t_max, best, any_hit)) break;
+    }
+    return best;
+}
+
+RT_TARGET_AVX512 inline int box_set::intersect_avx512(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    const slab_planes s = planes(r);
+    __m512d o[3], inv_d[3];
+    for (int a = 0; a < 3; a++)
+    {
+        o[a] = _mm512_set1_pd(r.origin()[a]);
+        inv_d[a] = _mm512_set1_pd(s.inv_d[a]);
+    }
+    const __m512d tmin = _mm512_set1_pd(t_min);
+    alignas(64) double t[8];
+    int best = -1;
+
+    for (size_t i = 0; i < count; i += 8)
+    {
+        // Masked forms with every lane selected: the unmasked min and max start from an
+        // undefined register, which GCC warns about.
+        __m512d t_near = _mm512_set1_pd(-infinity), t_far = _mm512_set1_pd(infinity);
+        for (int a = 0; a < 3; a++)
+        {
+            t_near = _mm512_mask_max_pd(t_near, 0xff, _mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(s.near_planes[a] + i), o[a]), inv_d[a]), t_near);
+            t_far = _mm512_mask_min_pd(t_far, 0xff, _mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(s.far_planes[a] + i), o[a]), inv_d[a]), t_far);
+        }
+        __mmask8 valid = _mm512_cmp_pd_mask(t_near, t_far, _CMP_LE_OQ);
+        if (valid == 0) continue;
+
+        __m512d root = _mm512_mask_blend_pd(_mm512_cmp_pd_mask(t_near, tmin, _CMP_GE_OQ), t_far, t_near);
+        int mask = valid & _mm512_cmp_pd_mask(root, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(root, _mm512_set1_pd(t_max), _CMP_LE_OQ);
+        if (mask == 0) continue;
+
+        _mm512_store_pd(t, root);
+        if (closer_lanes(mask, t, i, 8, t_max, best, any_hit)) break;
+    }
+    return best;
+}
+#endif
+
+// Gathers the boxes under node, giving up on anything else or on more than limit.
+inline bool collect_boxes(const bvh_node& node, std::vector<const box*>& boxes, size_t limit)
+{
+    // A single object node has left == right.
+    int child_count = node.left == node.right ? 1 : 2;
+    for (int i = 0; i < child_count; i++)
+    {
+        const auto& child = i == 0 ? node.left : node.right;
+        if (auto child_node = dynamic_cast<const bvh_node*>(child.get()))
+        {
+            if (!collect_boxes(*child_node, boxes, limit))
+                return false;
+            continue;
+        }
+
+        if (typeid(*child) != typeid(box) || boxes.size() == limit)
+            return false;
+        boxes.push_back(static_cast<const box*>(child.get()));
+    }
+    return true;
+}
+
+// One box_set holding every box of the subtree, or nullptr when the subtree has anything
+// but plain boxes, fewer than two or more than limit of them.
+inline shared_ptr<box_set> pack_boxes(const bvh_node& node, int limit)
+{
+    std::vector<const box*> boxes;
+    if (limit < 2 || !collect_boxes(node, boxes, limit) || boxes.size() < 2)
+        return nullptr;
+
+    auto set = make_shared<box_set>();
+    for (const box* b : boxes)
+        set->add(*b);
+    return set;
+}
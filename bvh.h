@@ -1,119 +1,298 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <future>
 
 #include "ray_trace_engine.h"
 #include "hittable.h"
 #include "hittable_list.h"
 
+// How a bvh_node picks the plane it splits its objects at.
+enum class bvh_split {
+    random_axis, // random axis, split at the median object
+    sah          // binned surface area heuristic
+};
+
+// Traversal counters, kept per thread and summed when a render thread finishes. They only
+// count in builds that define RT_TRAVERSAL_STATS, so other builds keep them out of the
+// traversal loops.
+struct traversal_stats {
+#ifdef RT_TRAVERSAL_STATS
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    static void count_node_visit()
+    {
+        if constexpr (enabled)
+            node_visits++;
+    }
+
+    static void count_rays(uint64_t count = 1)
+    {
+        if constexpr (enabled)
+            rays += count;
+    }
+
+    static inline thread_local uint64_t node_visits = 0;
+    static inline thread_local uint64_t rays = 0;
+
+    static inline std::atomic<uint64_t> total_node_visits = 0;
+    static inline std::atomic<uint64_t> total_rays = 0;
+
+    static void flush_thread()
+    {
+        total_node_visits += node_visits;
+        total_rays += rays;
+        node_visits = 0;
+        rays = 0;
+    }
 
+    static double node_visits_per_ray()
+    {
+        return total_rays > 0 ? double(total_node_visits) / double(total_rays) : 0.0;
+    }
+};
+
+// One entry of the index array a bvh_node is built over. Boxes and centroids are
+// computed once up front, so the build never calls bounding_box again.
+struct bvh_build_primitive {
+    aabb box;
+    point3 centroid;
+    size_t index;
+};
+
+// Shared state of one BVH build. Every node partitions its own [start, end) range of
+// primitives in place, so sibling subtrees can be built on different threads.
+struct bvh_build_context {
+    const std::vector<shared_ptr<hittable>>& objects;
+    std::vector<bvh_build_primitive> primitives;
+    double time0, time1;
+    bvh_split split;
+};
 
 class bvh_node : public hittable {
 public:
-    bvh_node();
+    bvh_node() {}
 
-    bvh_node(const hittable_list& list, double time0, double time1)
-        : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
+    bvh_node(const hittable_list& list, double time0, double time1, bvh_split split = bvh_split::random_axis)
+        : bvh_node(list.objects, 0, list.objects.size(), time0, time1, split)
     {
     }
 
     bvh_node(
         const std::vector<shared_ptr<hittable>>& src_objects,
-        size_t start, size_t end, double time0, double time1);
+        size_t start, size_t end, double time0, double time1,
+        bvh_split split = bvh_split::random_axis);
 
     virtual bool hit(
         const ray& r, double t_min, double t_max, hit_record& rec) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+    // Expected cost of a ray query under the surface area heuristic (traversal step = 1, primitive test = 1).
+    double sah_cost() const;
+
+    size_t node_count() const;
+
 public:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb box;
-};
 
+    static constexpr double traversal_cost = 1.0;
+    static constexpr double intersection_cost = 1.0;
 
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis)
-{
-    aabb box_a;
-    aabb box_b;
-
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    // Subtrees above this depth with enough primitives are built as parallel tasks.
+    static constexpr int parallel_build_depth = 4;
+    static constexpr size_t parallel_build_threshold = 4096;
 
-    return box_a.minim().e[axis] < box_b.minim().e[axis];
-}
+private:
+    void build(bvh_build_context& context, size_t start, size_t end, int depth);
+};
 
 
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+inline point3 box_centroid(const aabb& b)
 {
-    return box_compare(a, b, 0);
+    return 0.5 * (b.minim() + b.maxim());
 }
 
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
+// Binned SAH split of primitives[start, end) along the longest axis of the centroid bounds.
+// Partitions the range in place and returns the split position, or start when no
+// plane separates the primitives (e.g. all centroids coincide).
+inline size_t sah_partition(std::vector<bvh_build_primitive>& primitives, size_t start, size_t end)
 {
-    return box_compare(a, b, 1);
-}
+    const int bin_count = 16;
 
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b)
-{
-    return box_compare(a, b, 2);
-}
+    aabb centroid_bounds(primitives[start].centroid, primitives[start].centroid);
+    for (size_t i = start + 1; i < end; i++)
+    {
+        const point3& c = primitives[i].centroid;
+        centroid_bounds = surrounding_box(centroid_bounds, aabb(c, c));
+    }
+
+    int axis = centroid_bounds.longest_axis();
+    double cmin = centroid_bounds.minim()[axis];
+    double extent = centroid_bounds.maxim()[axis] - cmin;
+    if (extent <= 0)
+        return start;
+
+    auto bin_of = [&](const bvh_build_primitive& primitive) {
+        int bin = static_cast<int>(bin_count * ((primitive.centroid[axis] - cmin) / extent));
+        return std::min(bin, bin_count - 1);
+    };
+
+    size_t counts[bin_count] = {};
+    aabb bounds[bin_count];
+    for (size_t i = start; i < end; i++)
+    {
+        int bin = bin_of(primitives[i]);
+        bounds[bin] = counts[bin] == 0 ? primitives[i].box : surrounding_box(bounds[bin], primitives[i].box);
+        counts[bin]++;
+    }
+
+    // Sweep from the right to get the area and count of every right hand side,
+    // then from the left to evaluate each of the bin_count - 1 candidate planes.
+    double right_area[bin_count];
+    size_t right_count[bin_count];
+    aabb acc;
+    size_t n = 0;
+    for (int i = bin_count - 1; i > 0; i--)
+    {
+        if (counts[i] > 0)
+        {
+            acc = n == 0 ? bounds[i] : surrounding_box(acc, bounds[i]);
+            n += counts[i];
+        }
+        right_area[i] = n > 0 ? acc.area() : 0;
+        right_count[i] = n;
+    }
 
+    int best_split = -1;
+    double best_cost = infinity;
+    n = 0;
+    for (int i = 0; i < bin_count - 1; i++)
+    {
+        if (counts[i] > 0)
+        {
+            acc = n == 0 ? bounds[i] : surrounding_box(acc, bounds[i]);
+            n += counts[i];
+        }
+        if (n == 0 || right_count[i + 1] == 0)
+            continue;
+
+        double cost = n * acc.area() + right_count[i + 1] * right_area[i + 1];
+        if (cost < best_cost)
+        {
+            best_cost = cost;
+            best_split = i;
+        }
+    }
+
+    if (best_split < 0)
+        return start;
+
+    auto mid = std::partition(primitives.begin() + start, primitives.begin() + end,
+        [&](const bvh_build_primitive& primitive) { return bin_of(primitive) <= best_split; });
+
+    return mid - primitives.begin();
+}
 
 bvh_node::bvh_node(
     const std::vector<shared_ptr<hittable>>& src_objects,
-    size_t start, size_t end, double time0, double time1
+    size_t start, size_t end, double time0, double time1,
+    bvh_split split
 )
 {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
+    bvh_build_context context{ src_objects, {}, time0, time1, split };
 
-    int axis = random_int(0, 2);
-    auto comparator = (axis == 0) ? box_x_compare
-        : (axis == 1) ? box_y_compare
-        : box_z_compare;
+    context.primitives.reserve(end - start);
+    for (size_t i = start; i < end; i++)
+    {
+        aabb b;
+        if (!src_objects[i]->bounding_box(time0, time1, b))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+        context.primitives.push_back({ b, box_centroid(b), i });
+    }
+
+    build(context, 0, context.primitives.size(), 0);
+}
 
+inline void bvh_node::build(bvh_build_context& context, size_t start, size_t end, int depth)
+{
+    auto& primitives = context.primitives;
     size_t object_span = end - start;
 
+    // The random axis is a hash of the node's range rather than a draw from the scene
+    // stream, so the tree does not depend on which thread builds which subtree.
+    int axis = context.split == bvh_split::random_axis ? static_cast<int>(mix64(start * 0x9e3779b97f4a7c15ull + end) % 3) : 0;
+    auto comparator = [axis](const bvh_build_primitive& a, const bvh_build_primitive& b) {
+        return a.box.minim()[axis] < b.box.minim()[axis];
+    };
+
     if (object_span == 1)
     {
-        left = right = objects[start];
+        left = right = context.objects[primitives[start].index];
+        box = primitives[start].box;
+        return;
     }
-    else if (object_span == 2)
+
+    if (object_span == 2)
     {
-        if (comparator(objects[start], objects[start + 1]))
-        {
-            left = objects[start];
-            right = objects[start + 1];
-        }
-        else
-        {
-            left = objects[start + 1];
-            right = objects[start];
-        }
+        if (!comparator(primitives[start], primitives[start + 1]))
+            std::swap(primitives[start], primitives[start + 1]);
+
+        left = context.objects[primitives[start].index];
+        right = context.objects[primitives[start + 1].index];
+        box = surrounding_box(primitives[start].box, primitives[start + 1].box);
+        return;
     }
-    else
-    {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
-        auto mid = start + object_span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
+    size_t mid = start;
+    if (context.split == bvh_split::sah)
+        mid = sah_partition(primitives, start, end);
+
+    if (mid == start)
+    {
+        mid = start + object_span / 2;
+        std::nth_element(primitives.begin() + start, primitives.begin() + mid, primitives.begin() + end, comparator);
     }
 
-    aabb box_left, box_right;
+    auto build_child = [&context, depth](size_t child_start, size_t child_end) {
+        auto child = make_shared<bvh_node>();
+        child->build(context, child_start, child_end, depth + 1);
+        return child;
+    };
 
-    if (!left->bounding_box(time0, time1, box_left)
-        || !right->bounding_box(time0, time1, box_right)
-        )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    shared_ptr<bvh_node> left_node, right_node;
+    if (depth < parallel_build_depth && object_span >= parallel_build_threshold)
+    {
+        // The two halves touch disjoint ranges of the index array.
+        auto left_task = std::async(std::launch::async, build_child, start, mid);
+        right_node = build_child(mid, end);
+        left_node = left_task.get();
+    }
+    else
+    {
+        left_node = build_child(start, mid);
+        right_node = build_child(mid, end);
+    }
 
-    box = surrounding_box(box_left, box_right);
+    box = surrounding_box(left_node->box, right_node->box);
+    left = left_node;
+    right = right_node;
 }
 
 
 bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
+    traversal_stats::count_node_visit();
+
     if (!box.hit(r, t_min, t_max))
         return false;
 
@@ -124,8 +303,54 @@ bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
 }
 
 
+bool bvh_node::occluded(const ray& r, double t_min, double t_max) const
+{
+    traversal_stats::count_node_visit();
+
+    if (!box.hit(r, t_min, t_max))
+        return false;
+
+    return left->occluded(r, t_min, t_max) || (right != left && right->occluded(r, t_min, t_max));
+}
+
+
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const
 {
     output_box = box;
     return true;
+}
+
+
+double bvh_node::sah_cost() const
+{
+    auto child_cost = [](const shared_ptr<hittable>& child) {
+        auto node = dynamic_cast<const bvh_node*>(child.get());
+        return node ? node->sah_cost() : intersection_cost;
+    };
+
+    double area = box.area();
+    double cost = traversal_cost;
+
+    aabb child_box;
+    left->bounding_box(0, 1, child_box);
+    cost += (area > 0 ? child_box.area() / area : 1.0) * child_cost(left);
+    if (right != left)
+    {
+        right->bounding_box(0, 1, child_box);
+        cost += (area > 0 ? child_box.area() / area : 1.0) * child_cost(right);
+    }
+
+    return cost;
+}
+
+
+size_t bvh_node::node_count() const
+{
+    size_t count = 1;
+    if (auto node = dynamic_cast<const bvh_node*>(left.get()))
+        count += node->node_count();
+    if (right != left)
+        if (auto node = dynamic_cast<const bvh_node*>(right.get()))
+            count += node->node_count();
+    return count;
 }
\ No newline at end of file
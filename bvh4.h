@@ -0,0 +1,612 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+#include "sphere_set.h"
+#include "box_set.h"
+#include "cpu_features.h"
+
+// One node of a 4-wide BVH: the bounds of all four children in structure of arrays form,
+// so a single vector slab test covers every child. Bounds are floats rounded outwards;
+// the test itself runs in doubles so it stays as exact as the binary traversal.
+struct alignas(64) bvh4_node {
+    float bounds[2][3][4];      // [min / max][axis][child]
+    int32_t child[4];           // interior child: node index, leaf: first primitive, -1: empty slot
+    uint16_t primitive_count[4]; // 0 for interior children
+    uint8_t pad[8];
+};
+
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node must stay two cache lines");
+
+// A bvh_node tree collapsed into 4-wide nodes: each node takes the children of its
+// largest interior descendants until it has four, which halves the depth of the tree.
+// Children are visited nearest first and skipped when they start beyond the closest hit.
+class bvh4 : public hittable {
+public:
+    bvh4() {}
+
+    // time0 and time1 must be the shutter interval root was built for.
+    bvh4(const bvh_node& root, double time0, double time1,
+        int sphere_leaf_size = flat_bvh::default_sphere_leaf_size, int box_leaf_size = flat_bvh::default_box_leaf_size)
+        : sphere_leaf_size(sphere_leaf_size), box_leaf_size(box_leaf_size), time0(time0), time1(time1)
+    {
+        box = root.box;
+        nodes.emplace_back();
+        build(root, 0, 1);
+    }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual void hit_packet(ray_packet& packet) const override;
+
+    virtual bool bounding_box(double, double, aabb& output_box) const override
+    {
+        output_box = box;
+        return true;
+    }
+
+    size_t memory_bytes() const
+    {
+        return nodes.size() * sizeof(bvh4_node) + primitives.size() * sizeof(shared_ptr<hittable>);
+    }
+
+public:
+    std::vector<bvh4_node> nodes;
+    std::vector<shared_ptr<hittable>> primitives;
+    aabb box;
+    int sphere_leaf_size = flat_bvh::default_sphere_leaf_size;
+    int box_leaf_size = flat_bvh::default_box_leaf_size;
+    int depth = 0;
+    size_t sphere_set_count = 0;
+    size_t box_set_count = 0;
+    double time0 = 0, time1 = 1; // shutter interval the child bounds are taken over
+
+private:
+    // A child of a bvh_node while collapsing: either a subtree or a single primitive.
+    struct collapse_entry {
+        shared_ptr<hittable> object;
+        const bvh_node* node; // nullptr for primitives
+        aabb box;
+        double area;
+    };
+
+    collapse_entry make_entry(const shared_ptr<hittable>& object) const
+    {
+        collapse_entry entry{ object, dynamic_cast<const bvh_node*>(object.get()), aabb(), 0 };
+        object->bounding_box(time0, time1, entry.box);
+        entry.area = entry.box.area();
+        return entry;
+    }
+
+    // Subtrees that become a leaf as a whole: two primitives, or a packable group of spheres.
+    bool is_leaf(const collapse_entry& entry) const
+    {
+        if (!entry.node)
+            return true;
+        bool left_leaf = !dynamic_cast<const bvh_node*>(entry.node->left.get());
+        bool right_leaf = !dynamic_cast<const bvh_node*>(entry.node->right.get());
+        return left_leaf && right_leaf;
+    }
+
+    void set_bounds(int index, int slot, const aabb& b)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            nodes[index].bounds[0][a][slot] = flat_bvh::round_down(b.minim()[a]);
+            nodes[index].bounds[1][a][slot] = flat_bvh::round_up(b.maxim()[a]);
+        }
+    }
+
+    void add_leaf(int index, int slot, std::initializer_list<shared_ptr<hittable>> leaf_primitives)
+    {
+        nodes[index].child[slot] = static_cast<int32_t>(primitives.size());
+        nodes[index].primitive_count[slot] = static_cast<uint16_t>(leaf_primitives.size());
+        primitives.insert(primitives.end(), leaf_primitives);
+    }
+
+    void build(const bvh_node& node, int index, int level)
+    {
+        depth = std::max(depth, level);
+
+        std::vector<collapse_entry> children;
+        if (node.left == node.right)
+        {
+            children.push_back(make_entry(node.left));
+        }
+        else
+        {
+            children.push_back(make_entry(node.left));
+            children.push_back(make_entry(node.right));
+        }
+
+        // Open up the largest interior child until there are four. Sphere and box groups
+        // that will be packed stay closed.
+        while (children.size() < 4)
+        {
+            int largest = -1;
+            for (int i = 0; i < static_cast<int>(children.size()); i++)
+            {
+                const collapse_entry& entry = children[i];
+                if (is_leaf(entry) || packs(*entry.node))
+                    continue;
+                if (largest < 0 || entry.area > children[largest].area)
+                    largest = i;
+            }
+            if (largest < 0)
+                break;
+
+            const bvh_node* opened = children[largest].node;
+            children[largest] = make_entry(opened->left);
+            if (opened->right != opened->left)
+                children.push_back(make_entry(opened->right));
+        }
+
+        for (int slot = 0; slot < 4; slot++)
+        {
+            nodes[index].child[slot] = -1;
+            nodes[index].primitive_count[slot] = 0;
+            for (int a = 0; a < 3; a++)
+            {
+                nodes[index].bounds[0][a][slot] = std::numeric_limits<float>::infinity();
+                nodes[index].bounds[1][a][slot] = -std::numeric_limits<float>::infinity();
+            }
+        }
+
+        for (int slot = 0; slot < static_cast<int>(children.size()); slot++)
+        {
+            const collapse_entry& entry = children[slot];
+            set_bounds(index, slot, entry.box);
+
+            if (!entry.node)
+            {
+                add_leaf(index, slot, { entry.object });
+            }
+            else if (auto set = pack_spheres(*entry.node, sphere_leaf_size))
+            {
+                sphere_set_count++;
+                add_leaf(index, slot, { set });
+            }
+            else if (auto set = pack_boxes(*entry.node, box_leaf_size))
+            {
+                box_set_count++;
+                add_leaf(index, slot, { set });
+            }
+            else if (entry.node->left == entry.node->right)
+            {
+                add_leaf(index, slot, { entry.node->left });
+            }
+            else if (is_leaf(entry))
+            {
+                add_leaf(index, slot, { entry.node->left, entry.node->right });
+            }
+            else
+            {
+                int child_index = static_cast<int>(nodes.size());
+                nodes.emplace_back();
+                nodes[index].child[slot] = child_index;
+                build(*entry.node, child_index, level + 1);
+            }
+        }
+    }
+
+    // Whether the subtree will become a single sphere_set or box_set leaf.
+    bool packs(const bvh_node& node) const
+    {
+        std::vector<const sphere*> spheres;
+        std::vector<const ::box*> boxes;
+        return (sphere_leaf_size > 1 && collect_spheres(node, spheres, sphere_leaf_size) && spheres.size() > 1)
+            || (box_leaf_size > 1 && collect_boxes(node, boxes, box_leaf_size) && boxes.size() > 1);
+    }
+
+    // Per ray constants of the slab test.
+    struct ray_slabs {
+        double origin[3];
+        double inv_dir[3];
+        int near_side[3]; // bounds[near_side[a]][a] is the entry plane on axis a
+    };
+
+    static ray_slabs make_slabs(const ray& r)
+    {
+        ray_slabs s;
+        for (int a = 0; a < 3; a++)
+        {
+            s.origin[a] = r.origin()[a];
+            s.inv_dir[a] = r.inverse_direction()[a];
+            s.near_side[a] = r.direction_sign(a);
+        }
+        return s;
+    }
+
+    // Entry distance of every child the ray overlaps within [t_min, t_max]; returns the mask of those children.
+    static int node_hit(const bvh4_node& node, const ray_slabs& s, double t_min, double t_max, double t_near[4])
+    {
+        switch (cpu_features::level)
+        {
+#ifdef RT_X86_64
+        case simd_level::avx512:
+        case simd_level::avx2: return node_hit_avx2(node, s, t_min, t_max, t_near);
+        case simd_level::sse2: return node_hit_sse2(node, s, t_min, t_max, t_near);
+#endif
+        default: return node_hit_scalar(node, s, t_min, t_max, t_near);
+        }
+    }
+
+    static int node_hit_scalar(const bvh4_node& node, const ray_slabs& s, double t_min, double t_max, double t_near[4])
+    {
+        int mask = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            if (child_hit(node, c, s, t_min, t_max, t_near[c]))
+                mask |= 1 << c;
+        }
+        return mask;
+    }
+
+    static bool child_hit(const bvh4_node& node, int c, const ray_slabs& s, double t_min, double t_max, double& t_near)
+    {
+        double t0 = t_min, t1 = t_max;
+        for (int a = 0; a < 3; a++)
+        {
+            double near_t = (node.bounds[s.near_side[a]][a][c] - s.origin[a]) * s.inv_dir[a];
+            double far_t = (node.bounds[1 - s.near_side[a]][a][c] - s.origin[a]) * s.inv_dir[a];
+            t0 = near_t > t0 ? near_t : t0;
+            t1 = far_t < t1 ? far_t : t1;
+        }
+        t_near = t0;
+        return t0 < t1;
+    }
+
+    // Bounds on the origins and inverse directions of a packet's rays. Slab distances
+    // computed with these intervals bound those of every ray in the packet.
+    struct packet_interval {
+        double origin_lo[3], origin_hi[3];
+        double inv_lo[3], inv_hi[3];
+        int near_side[3];
+    };
+
+    // False when the rays do not all point the same way along every axis (or run parallel
+    // to one), then no finite interval holds their inverse directions.
+    static bool make_interval(const ray_slabs* slabs, int count, packet_interval& iv)
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            iv.near_side[a] = slabs[0].near_side[a];
+            iv.origin_lo[a] = iv.origin_hi[a] = slabs[0].origin[a];
+            iv.inv_lo[a] = iv.inv_hi[a] = slabs[0].inv_dir[a];
+            for (int k = 0; k < count; k++)
+            {
+                if (slabs[k].near_side[a] != iv.near_side[a] || !std::isfinite(slabs[k].inv_dir[a]))
+                    return false;
+                iv.origin_lo[a] = std::min(iv.origin_lo[a], slabs[k].origin[a]);
+                iv.origin_hi[a] = std::max(iv.origin_hi[a], slabs[k].origin[a]);
+                iv.inv_lo[a] = std::min(iv.inv_lo[a], slabs[k].inv_dir[a]);
+                iv.inv_hi[a] = std::max(iv.inv_hi[a], slabs[k].inv_dir[a]);
+            }
+        }
+        return true;
+    }
+
+    // Lower bound on the entry distance of any ray of the packet into each child; returns
+    // the children that at least one of them might hit within [t_min, t_max].
+    static int node_hit_interval(const bvh4_node& node, const packet_interval& iv, double t_min, double t_max, double t_near[4])
+    {
+#ifdef RT_X86_64
+        if (cpu_features::level >= simd_level::avx2)
+            return node_hit_interval_avx2(node, iv, t_min, t_max, t_near);
+#endif
+        int mask = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            double t0 = t_min, t1 = t_max;
+            for (int a = 0; a < 3; a++)
+            {
+                // (plane - origin) * inv_dir over both intervals: the extremes lie on the corners.
+                double near_plane = node.bounds[iv.near_side[a]][a][c];
+                double far_plane = node.bounds[1 - iv.near_side[a]][a][c];
+                double n_lo = near_plane - iv.origin_hi[a], n_hi = near_plane - iv.origin_lo[a];
+                double f_lo = far_plane - iv.origin_hi[a], f_hi = far_plane - iv.origin_lo[a];
+                double near_t = std::min(std::min(n_lo * iv.inv_lo[a], n_lo * iv.inv_hi[a]), std::min(n_hi * iv.inv_lo[a], n_hi * iv.inv_hi[a]));
+                double far_t = std::max(std::max(f_lo * iv.inv_lo[a], f_lo * iv.inv_hi[a]), std::max(f_hi * iv.inv_lo[a], f_hi * iv.inv_hi[a]));
+                t0 = near_t > t0 ? near_t : t0;
+                t1 = far_t < t1 ? far_t : t1;
+            }
+            t_near[c] = t0;
+            if (t0 < t1) mask |= 1 << c;
+        }
+        return mask;
+    }
+
+#ifdef RT_X86_64
+    static int node_hit_sse2(const bvh4_node& node, const ray_slabs& s, double t_min, double t_max, double t_near[4])
+    {
+        int mask = 0;
+        for (int half = 0; half < 2; half++)
+        {
+            __m128d t0 = _mm_set1_pd(t_min);
+            __m128d t1 = _mm_set1_pd(t_max);
+            for (int a = 0; a < 3; a++)
+            {
+                __m128d o = _mm_set1_pd(s.origin[a]);
+                __m128d inv = _mm_set1_pd(s.inv_dir[a]);
+                __m128d lo = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&node.bounds[s.near_side[a]][a][2 * half]))));
+                __m128d hi = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&node.bounds[1 - s.near_side[a]][a][2 * half]))));
+                // max / min return the second operand for NaN (0 * inf), which ignores the axis.
+                t0 = _mm_max_pd(_mm_mul_pd(_mm_sub_pd(lo, o), inv), t0);
+                t1 = _mm_min_pd(_mm_mul_pd(_mm_sub_pd(hi, o), inv), t1);
+            }
+            _mm_storeu_pd(&t_near[2 * half], t0);
+            mask |= _mm_movemask_pd(_mm_cmplt_pd(t0, t1)) << (2 * half);
+        }
+        return mask;
+    }
+
+    RT_TARGET_AVX2 static int node_hit_avx2(const bvh4_node& node, const ray_slabs& s, double t_min, double t_max, double t_near[4])
+    {
+        __m256d t0 = _mm256_set1_pd(t_min);
+        __m256d t1 = _mm256_set1_pd(t_max);
+        for (int a = 0; a < 3; a++)
+        {
+            __m256d o = _mm256_set1_pd(s.origin[a]);
+            __m256d inv = _mm256_set1_pd(s.inv_dir[a]);
+            __m256d lo = _mm256_cvtps_pd(_mm_load_ps(node.bounds[s.near_side[a]][a]));
+            __m256d hi = _mm256_cvtps_pd(_mm_load_ps(node.bounds[1 - s.near_side[a]][a]));
+            t0 = _mm256_max_pd(_mm256_mul_pd(_mm256_sub_pd(lo, o), inv), t0);
+            t1 = _mm256_min_pd(_mm256_mul_pd(_mm256_sub_pd(hi, o), inv), t1);
+        }
+        _mm256_storeu_pd(t_near, t0);
+        return _mm256_movemask_pd(_mm256_cmp_pd(t0, t1, _CMP_LT_OQ));
+    }
+
+    RT_TARGET_AVX2 static int node_hit_interval_avx2(const bvh4_node& node, const packet_interval& iv, double t_min, double t_max, double t_near[4])
+    {
+        __m256d t0 = _mm256_set1_pd(t_min);
+        __m256d t1 = _mm256_set1_pd(t_max);
+        for (int a = 0; a < 3; a++)
+        {
+            __m256d o_lo = _mm256_set1_pd(iv.origin_lo[a]);
+            __m256d o_hi = _mm256_set1_pd(iv.origin_hi[a]);
+            __m256d inv_lo = _mm256_set1_pd(iv.inv_lo[a]);
+            __m256d inv_hi = _mm256_set1_pd(iv.inv_hi[a]);
+            __m256d near_plane = _mm256_cvtps_pd(_mm_load_ps(node.bounds[iv.near_side[a]][a]));
+            __m256d far_plane = _mm256_cvtps_pd(_mm_load_ps(node.bounds[1 - iv.near_side[a]][a]));
+            __m256d n_lo = _mm256_sub_pd(near_plane, o_hi), n_hi = _mm256_sub_pd(near_plane, o_lo);
+            __m256d f_lo = _mm256_sub_pd(far_plane, o_hi), f_hi = _mm256_sub_pd(far_plane, o_lo);
+            __m256d near_t = _mm256_min_pd(
+                _mm256_min_pd(_mm256_mul_pd(n_lo, inv_lo), _mm256_mul_pd(n_lo, inv_hi)),
+                _mm256_min_pd(_mm256_mul_pd(n_hi, inv_lo), _mm256_mul_pd(n_hi, inv_hi)));
+            __m256d far_t = _mm256_max_pd(
+                _mm256_max_pd(_mm256_mul_pd(f_lo, inv_lo), _mm256_mul_pd(f_lo, inv_hi)),
+                _mm256_max_pd(_mm256_mul_pd(f_hi, inv_lo), _mm256_mul_pd(f_hi, inv_hi)));
+            t0 = _mm256_max_pd(near_t, t0);
+            t1 = _mm256_min_pd(far_t, t1);
+        }
+        _mm256_storeu_pd(t_near, t0);
+        return _mm256_movemask_pd(_mm256_cmp_pd(t0, t1, _CMP_LT_OQ));
+    }
+#endif
+
+    struct stack_entry {
+        int32_t index;
+        uint16_t primitive_count;
+        double t_near;
+    };
+
+    // Packet traversal keeps leaves as (node, slot), so each ray can test the leaf's own box.
+    struct packet_entry {
+        int32_t node;
+        int32_t slot; // -1 for the node itself
+        double t_near;
+    };
+
+    // Walks the tree nearest child first. leaf(first, count, t_max) tests a leaf's
+    // primitives, may shrink t_max and returns true to end the walk early.
+    template <typename leaf_test>
+    void traverse(const ray& r, double t_min, double& t_max, bool ordered, leaf_test leaf) const;
+};
+
+template <typename leaf_test>
+inline void bvh4::traverse(const ray& r, double t_min, double& t_max, bool ordered, leaf_test leaf) const
+{
+    if (nodes.empty())
+        return;
+
+    const ray_slabs slabs = make_slabs(r);
+
+    // Every level of the tree leaves at most three siblings behind on the stack.
+    stack_entry local_stack[96];
+    std::vector<stack_entry> deep_stack;
+    stack_entry* stack = local_stack;
+    if (3 * depth + 1 > 96)
+    {
+        deep_stack.resize(3 * depth + 1);
+        stack = deep_stack.data();
+    }
+
+    int stack_size = 0;
+    stack[stack_size++] = { 0, 0, t_min };
+
+    while (stack_size > 0)
+    {
+        stack_entry entry = stack[--stack_size];
+        if (entry.t_near > t_max)
+            continue;
+
+        if (entry.primitive_count > 0)
+        {
+            if (leaf(entry.index, entry.primitive_count, t_max))
+                return;
+            continue;
+        }
+
+        const bvh4_node& node = nodes[entry.index];
+        traversal_stats::count_node_visit();
+
+        double t_near[4];
+        int mask = node_hit(node, slabs, t_min, t_max, t_near);
+        if (mask == 0)
+            continue;
+
+        // Push the hit children farthest first, so the nearest is popped next.
+        int first = stack_size;
+        for (int c = 0; c < 4; c++)
+        {
+            if (!(mask >> c & 1))
+                continue;
+            stack_entry child = { node.child[c], node.primitive_count[c], t_near[c] };
+            int i = stack_size++;
+            if (ordered)
+            {
+                while (i > first && stack[i - 1].t_near < child.t_near)
+                {
+                    stack[i] = stack[i - 1];
+                    i--;
+                }
+            }
+            stack[i] = child;
+        }
+    }
+}
+
+inline bool bvh4::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+    bool hit_anything = false;
+
+    traverse(r, t_min, t_max, true, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            if (primitives[i]->hit(r, t_min, closest, rec))
+            {
+                hit_anything = true;
+                closest = rec.t;
+            }
+        }
+        return false;
+    });
+
+    return hit_anything;
+}
+
+inline bool bvh4::occluded(const ray& r, double t_min, double t_max) const
+{
+    bool blocked = false;
+
+    traverse(r, t_min, t_max, false, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            if (primitives[i]->occluded(r, t_min, closest))
+                return blocked = true;
+        }
+        return false;
+    });
+
+    return blocked;
+}
+
+inline void bvh4::hit_packet(ray_packet& packet) const
+{
+    if (nodes.empty() || packet.size == 0)
+        return;
+
+    ray_slabs slabs[ray_packet::max_size];
+    for (int k = 0; k < packet.size; k++)
+        slabs[k] = make_slabs(packet.rays[k]);
+
+    // Rays that diverge this much gain nothing from sharing the traversal.
+    packet_interval interval;
+    if (!make_interval(slabs, packet.size, interval))
+    {
+        hittable::hit_packet(packet);
+        return;
+    }
+
+    // Nodes are culled for the whole packet: only when they lie beyond every ray's closest hit.
+    auto farthest_t_max = [&packet]() {
+        double t = packet.t_max[0];
+        for (int k = 1; k < packet.size; k++)
+            t = packet.t_max[k] > t ? packet.t_max[k] : t;
+        return t;
+    };
+    double packet_t_max = farthest_t_max();
+    // Likewise their near side is tested against the smallest near limit of the rays.
+    double packet_t_min = packet.t_min[0];
+    for (int k = 1; k < packet.size; k++)
+        packet_t_min = packet.t_min[k] < packet_t_min ? packet.t_min[k] : packet_t_min;
+
+    packet_entry local_stack[96];
+    std::vector<packet_entry> deep_stack;
+    packet_entry* stack = local_stack;
+    if (3 * depth + 1 > 96)
+    {
+        deep_stack.resize(3 * depth + 1);
+        stack = deep_stack.data();
+    }
+
+    int stack_size = 0;
+    stack[stack_size++] = { 0, -1, packet_t_min };
+
+    while (stack_size > 0)
+    {
+        packet_entry entry = stack[--stack_size];
+        if (entry.t_near > packet_t_max)
+            continue;
+
+        const bvh4_node& node = nodes[entry.node];
+
+        if (entry.slot >= 0)
+        {
+            // Leaves are where the rays part: each tests the leaf's box on its own first.
+            int first = node.child[entry.slot];
+            int count = node.primitive_count[entry.slot];
+            for (int k = 0; k < packet.size; k++)
+            {
+                double t_near;
+                if (!child_hit(node, entry.slot, slabs[k], packet.t_min[k], packet.t_max[k], t_near))
+                    continue;
+
+                std::swap(thread_sampler, packet.streams[k]);
+                for (int i = first; i < first + count; i++)
+                {
+                    if (primitives[i]->hit(packet.rays[k], packet.t_min[k], packet.t_max[k], packet.recs[k]))
+                        packet.t_max[k] = packet.recs[k].t;
+                }
+                std::swap(thread_sampler, packet.streams[k]);
+            }
+            packet_t_max = farthest_t_max();
+            continue;
+        }
+
+        traversal_stats::count_node_visit();
+
+        double t_near[4];
+        int mask = node_hit_interval(node, interval, packet_t_min, packet_t_max, t_near);
+        if (mask == 0)
+            continue;
+
+        // Push the hit children farthest first, so the nearest is popped next.
+        int first = stack_size;
+        for (int c = 0; c < 4; c++)
+        {
+            if (!(mask >> c & 1))
+                continue;
+            packet_entry child = node.primitive_count[c] > 0
+                ? packet_entry{ entry.node, c, t_near[c] }
+                : packet_entry{ node.child[c], -1, t_near[c] };
+            int i = stack_size++;
+            while (i > first && stack[i - 1].t_near < child.t_near)
+            {
+                stack[i] = stack[i - 1];
+                i--;
+            }
+            stack[i] = child;
+        }
+    }
+}
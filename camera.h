@@ -2,6 +2,7 @@
 
 #include "ray_trace_engine.h"
 #include "ray.h"
+#include "sampling.h"
 
 class camera {
 public:
@@ -10,14 +10,14 @@ public:
     constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
         : boundary(b),
         neg_inv_density(-1 / d),
-        phase_function(make_shared<isotropic>(a))
+        phase_function(scene_materials.add(make_shared<isotropic>(a)))
     {
     }
 
     constant_medium(shared_ptr<hittable> b, double d, color c)
         : boundary(b),
         neg_inv_density(-1 / d),
-        phase_function(make_shared<isotropic>(c))
+        phase_function(scene_materials.add(make_shared<isotropic>(c)))
     {
     }
 
@@ -31,7 +31,7 @@ public:
 
 public:
     shared_ptr<hittable> boundary;
-    shared_ptr<material> phase_function;
+    material_handle phase_function;
     double neg_inv_density;
 };
 
@@ -79,7 +79,8 @@ inline bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_r
 
     rec.normal = vector3(1, 0, 0);  // arbitrary
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat = phase_function;
+    rec.prim = this;
 
     return true;
 }
\ No newline at end of file
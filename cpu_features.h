@@ -0,0 +1,84 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define RT_X86_64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// GCC and Clang only emit AVX instructions inside functions marked for that target,
+// MSVC accepts the intrinsics anywhere.
+#if defined(RT_X86_64) && (defined(__GNUC__) || defined(__clang__))
+#define RT_TARGET_AVX2 __attribute__((target("avx2")))
+#define RT_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define RT_TARGET_AVX2
+#define RT_TARGET_AVX512
+#endif
+
+// Widest vector instruction set the SIMD kernels may use, in increasing order.
+enum class simd_level {
+    scalar,
+    sse2,   // 2 doubles
+    avx2,   // 4 doubles
+    avx512  // 8 doubles
+};
+
+struct cpu_features {
+    // What this CPU (and OS) supports.
+    static simd_level detect()
+    {
+#if defined(RT_X86_64) && defined(_MSC_VER) && !defined(__clang__)
+        int info[4];
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+        __cpuidex(info, 7, 0); // leaf 7 has subleaves: ask for 0
+        bool avx2 = avx && (info[1] & (1 << 5)) != 0 && (xcr0 & 0x6) == 0x6;
+        bool avx512 = avx2 && (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+
+        return avx512 ? simd_level::avx512 : avx2 ? simd_level::avx2 : simd_level::sse2;
+#elif defined(RT_X86_64)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return simd_level::avx512;
+        if (__builtin_cpu_supports("avx2")) return simd_level::avx2;
+        return simd_level::sse2;
+#else
+        return simd_level::scalar;
+#endif
+    }
+
+    // Caps the level, e.g. to compare kernels. Never goes above what was detected.
+    static void limit(simd_level requested)
+    {
+        level = std::min(requested, detect());
+    }
+
+    static const char* name(simd_level l)
+    {
+        switch (l){
+        case simd_level::avx512: return "avx512";
+        case simd_level::avx2: return "avx2";
+        case simd_level::sse2: return "sse2";
+        default: return "scalar";
+        }
+    }
+
+    static simd_level parse(const std::string& s)
+    {
+        if (s == "scalar") return simd_level::scalar;
+        if (s == "sse2") return simd_level::sse2;
+        if (s == "avx2") return simd_level::avx2;
+        return simd_level::avx512;
+    }
+
+    // Level the kernels dispatch on.
+    static inline simd_level level = detect();
+};
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "vector3.h"
+#include "color.h"
+
+// Floating point accumulation buffer: the running radiance sum and sample count of
+// every pixel, kept in doubles whatever real is so long renders do not lose samples.
+// Progressive passes keep adding to it, and the current estimate can be developed into
+// the 8-bit image buffer at any time.
+class film {
+public:
+    film(int image_width, int image_height)
+        : width(image_width), height(image_height),
+        sum(static_cast<size_t>(image_width) * image_height),
+        luminance_sq(static_cast<size_t>(image_width) * image_height, 0.0),
+        samples(static_cast<size_t>(image_width) * image_height, 0)
+    {
+    }
+
+    // Each pixel is only ever touched by the thread that owns its tile.
+    void add_sample(int pixel, const color& radiance)
+    {
+        double l = luminance(radiance);
+        sum[pixel] += vector3_t<double>(radiance);
+        luminance_sq[pixel] += l * l;
+        samples[pixel]++;
+    }
+
+    template <typename T>
+    static double luminance(const vector3_t<T>& c)
+    {
+        return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+    }
+
+    // Standard error of the pixel's mean luminance, measured after the gamma 2 transfer
+    // used by write_color, so the threshold is in display units (1/255 = one 8-bit step).
+    double display_error(int pixel) const
+    {
+        int n = samples[pixel];
+        if (n < 2) return infinity;
+
+        double mean = luminance(sum[pixel]) / n;
+        double variance = std::fmax(0.0, (luminance_sq[pixel] - mean * mean * n) / (n - 1));
+        double standard_error = sqrt(variance / n);
+
+        return standard_error / (2 * sqrt(std::fmax(mean, 1e-4)));
+    }
+
+    long long total_samples() const
+    {
+        long long total = 0;
+        for (int count : samples) total += count;
+        return total;
+    }
+
+    int sample_count(int pixel) const { return samples[pixel]; }
+
+    double average_samples() const
+    {
+        return samples.empty() ? 0 : double(total_samples()) / samples.size();
+    }
+
+    color estimate(int pixel) const
+    {
+        return samples[pixel] > 0 ? color(sum[pixel] / samples[pixel]) : color(0, 0, 0);
+    }
+
+    void develop(std::vector<unsigned char>& image_buffer, int pixel) const
+    {
+        write_color(image_buffer, pixel, color(sum[pixel]), samples[pixel] > 0 ? samples[pixel] : 1);
+    }
+
+    void develop(std::vector<unsigned char>& image_buffer) const
+    {
+        for (int pixel = 0; pixel < width * height; pixel++)
+            develop(image_buffer, pixel);
+    }
+
+public:
+    int width, height;
+    std::vector<vector3_t<double>> sum;
+    std::vector<double> luminance_sq;
+    std::vector<int> samples;
+};
+
+// Adaptive sampling settings: every pixel gets at least min_spp samples, then keeps
+// sampling until its display_error drops below the threshold or it reaches max_spp.
+struct adaptive_settings {
+    bool enabled = false;
+    int min_spp = 16;
+    int max_spp = 0;          // 0 = 4 x samples_per_pixel
+    double threshold = 0.005; // display units
+
+    // Number of samples the pixel should take in a pass of pass_samples.
+    int samples_wanted(const film& accumulation, int pixel, int pass_samples) const
+    {
+        int n = accumulation.sample_count(pixel);
+        if (n >= max_spp) return 0;
+        if (n >= min_spp && accumulation.display_error(pixel) < threshold) return 0;
+        return std::min(std::max(pass_samples, min_spp - n), max_spp - n);
+    }
+};
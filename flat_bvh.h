@@ -0,0 +1,355 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "sphere_set.h"
+#include "box_set.h"
+
+// One node of a flattened BVH, 32 bytes so two fit in a cache line.
+// Bounds are stored as floats, rounded outwards so the box never shrinks.
+struct flat_bvh_node {
+    float bounds_min[3];
+    float bounds_max[3];
+    int32_t offset;           // interior: index of the second child, leaf: first primitive
+    uint16_t primitive_count; // 0 for interior nodes
+    uint8_t axis;             // interior: axis the children are ordered along
+    uint8_t pad;
+};
+
+static_assert(sizeof(flat_bvh_node) == 32, "flat_bvh_node must stay 32 bytes");
+
+// A bvh_node tree compacted into one array in depth-first order: the first child of a node
+// is always the next node in the array, only the second child's index is stored.
+// Traversal is an iterative loop with a small stack instead of virtual calls through the tree.
+// Subtrees of at most sphere_leaf_size plain spheres become a single leaf holding a
+// sphere_set, which tests them all with a few SIMD instructions (0 or 1 turns this off);
+// subtrees of at most box_leaf_size boxes likewise become a box_set.
+class flat_bvh : public hittable {
+public:
+    static constexpr int default_sphere_leaf_size = 16;
+    static constexpr int default_box_leaf_size = 4;
+
+    flat_bvh() {}
+
+    flat_bvh(const hittable_list& list, double time0, double time1, bvh_split split = bvh_split::sah)
+        : flat_bvh(bvh_node(list, time0, time1, split), time0, time1)
+    {
+    }
+
+    // time0 and time1 must be the shutter interval root was built for.
+    flat_bvh(const bvh_node& root, double time0, double time1,
+        int sphere_leaf_size = default_sphere_leaf_size, int box_leaf_size = default_box_leaf_size)
+        : sphere_leaf_size(sphere_leaf_size), box_leaf_size(box_leaf_size), time0(time0), time1(time1)
+    {
+        box = root.box;
+        flatten(root, 1);
+    }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+    virtual bool bounding_box(double, double, aabb& output_box) const override
+    {
+        output_box = box;
+        return !nodes.empty();
+    }
+
+    size_t memory_bytes() const
+    {
+        return nodes.size() * sizeof(flat_bvh_node) + primitives.size() * sizeof(shared_ptr<hittable>);
+    }
+
+public:
+    std::vector<flat_bvh_node> nodes;
+    std::vector<shared_ptr<hittable>> primitives;
+    aabb box;
+    int depth = 0;
+    int sphere_leaf_size = default_sphere_leaf_size;
+    int box_leaf_size = default_box_leaf_size;
+    size_t sphere_set_count = 0;
+    size_t box_set_count = 0;
+    double time0 = 0, time1 = 1; // shutter interval the child bounds are taken over
+
+    // Float bounds that never shrink the box they are rounded from, and the slab test
+    // on them. Also used by the BVHs of triangle meshes and bvh4.
+    static float round_down(double x)
+    {
+        float f = static_cast<float>(x);
+        return f > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static float round_up(double x)
+    {
+        float f = static_cast<float>(x);
+        return f < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+    }
+
+    static bool node_hit(const flat_bvh_node& node, const ray& r, double t_min, double t_max)
+    {
+        const vector3& inv_dir = r.inverse_direction();
+        for (int a = 0; a < 3; a++)
+        {
+            int sign = r.direction_sign(a);
+            double t0 = ((sign ? node.bounds_max : node.bounds_min)[a] - r.origin()[a]) * inv_dir[a];
+            double t1 = ((sign ? node.bounds_min : node.bounds_max)[a] - r.origin()[a]) * inv_dir[a];
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+        }
+        return t_min < t_max;
+    }
+
+    // Walks every node of a flattened tree the ray overlaps, nearer child first.
+    // leaf(first, count, t_max) tests the primitives of a leaf, may shrink t_max and
+    // returns true to end the walk early. depth is the number of levels in the tree.
+    template <typename leaf_test>
+    static void traverse(const std::vector<flat_bvh_node>& nodes, int depth, const ray& r, double t_min, double& t_max, leaf_test leaf);
+
+    // Builds a flattened SAH tree straight from primitive boxes, for structures that store
+    // their own primitives: primitives[start, end) is reordered so every leaf of at most
+    // leaf_size primitives is one contiguous range. Returns the index of the subtree root.
+    static int build_nodes(std::vector<flat_bvh_node>& nodes, int& depth, std::vector<bvh_build_primitive>& primitives,
+        size_t start, size_t end, int leaf_size, int level = 1);
+
+private:
+    int add_node(const aabb& b)
+    {
+        flat_bvh_node node = {};
+        for (int a = 0; a < 3; a++)
+        {
+            node.bounds_min[a] = round_down(b.minim()[a]);
+            node.bounds_max[a] = round_up(b.maxim()[a]);
+        }
+        nodes.push_back(node);
+        return static_cast<int>(nodes.size() - 1);
+    }
+
+    void add_leaf(const aabb& b, std::initializer_list<shared_ptr<hittable>> leaf_primitives)
+    {
+        int index = add_node(b);
+        nodes[index].offset = static_cast<int32_t>(primitives.size());
+        nodes[index].primitive_count = static_cast<uint16_t>(leaf_primitives.size());
+        primitives.insert(primitives.end(), leaf_primitives);
+    }
+
+    void flatten_child(const shared_ptr<hittable>& child, int level)
+    {
+        if (auto node = dynamic_cast<const bvh_node*>(child.get()))
+        {
+            flatten(*node, level);
+            return;
+        }
+
+        aabb b;
+        child->bounding_box(time0, time1, b);
+        depth = std::max(depth, level);
+        add_leaf(b, { child });
+    }
+
+    void flatten(const bvh_node& node, int level)
+    {
+        if (auto set = pack_spheres(node, sphere_leaf_size))
+        {
+            depth = std::max(depth, level);
+            sphere_set_count++;
+            add_leaf(node.box, { set });
+            return;
+        }
+
+        if (auto set = pack_boxes(node, box_leaf_size))
+        {
+            depth = std::max(depth, level);
+            box_set_count++;
+            add_leaf(node.box, { set });
+            return;
+        }
+
+        auto left = dynamic_cast<const bvh_node*>(node.left.get());
+        auto right = dynamic_cast<const bvh_node*>(node.right.get());
+
+        // Two primitives (or one, for a single object tree) go into a single leaf.
+        if (!left && !right)
+        {
+            depth = std::max(depth, level);
+            if (node.left == node.right)
+                add_leaf(node.box, { node.left });
+            else
+                add_leaf(node.box, { node.left, node.right });
+            return;
+        }
+
+        aabb box_left, box_right;
+        node.left->bounding_box(time0, time1, box_left);
+        node.right->bounding_box(time0, time1, box_right);
+
+        // Order the children along the axis that separates them the most, so the
+        // traversal can visit the nearer one first from the ray direction sign alone.
+        vector3 separation = box_centroid(box_right) - box_centroid(box_left);
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (fabs(separation[a]) > fabs(separation[axis])) axis = a;
+
+        auto first = node.left;
+        auto second = node.right;
+        if (separation[axis] < 0)
+            std::swap(first, second);
+
+        int index = add_node(node.box);
+        nodes[index].axis = static_cast<uint8_t>(axis);
+        flatten_child(first, level + 1);
+        nodes[index].offset = static_cast<int32_t>(nodes.size());
+        flatten_child(second, level + 1);
+    }
+
+};
+
+template <typename leaf_test>
+inline void flat_bvh::traverse(const std::vector<flat_bvh_node>& nodes, int depth, const ray& r, double t_min, double& t_max, leaf_test leaf)
+{
+    if (nodes.empty())
+        return;
+
+    int local_stack[64];
+    std::vector<int> deep_stack;
+    int* stack = local_stack;
+    if (depth > 64)
+    {
+        deep_stack.resize(depth);
+        stack = deep_stack.data();
+    }
+
+    int stack_size = 0;
+    int current = 0;
+
+    while (true)
+    {
+        const flat_bvh_node& node = nodes[current];
+        traversal_stats::count_node_visit();
+
+        if (node_hit(node, r, t_min, t_max))
+        {
+            if (node.primitive_count > 0)
+            {
+                if (leaf(node.offset, node.primitive_count, t_max))
+                    return;
+            }
+            else
+            {
+                // Descend into the nearer child, remember the farther one.
+                if (r.direction_sign(node.axis))
+                {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                }
+                else
+                {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+}
+
+inline int flat_bvh::build_nodes(std::vector<flat_bvh_node>& nodes, int& depth, std::vector<bvh_build_primitive>& primitives,
+    size_t start, size_t end, int leaf_size, int level)
+{
+    aabb bounds = primitives[start].box;
+    for (size_t i = start + 1; i < end; i++)
+        bounds = surrounding_box(bounds, primitives[i].box);
+
+    int index = static_cast<int>(nodes.size());
+    flat_bvh_node node = {};
+    for (int a = 0; a < 3; a++)
+    {
+        node.bounds_min[a] = round_down(bounds.minim()[a]);
+        node.bounds_max[a] = round_up(bounds.maxim()[a]);
+    }
+    nodes.push_back(node);
+    depth = std::max(depth, level);
+
+    if (end - start <= static_cast<size_t>(leaf_size))
+    {
+        nodes[index].offset = static_cast<int32_t>(start);
+        nodes[index].primitive_count = static_cast<uint16_t>(end - start);
+        return index;
+    }
+
+    size_t mid = sah_partition(primitives, start, end);
+    if (mid == start)
+    {
+        // All centroids coincide: any split is as good as another.
+        mid = start + (end - start) / 2;
+    }
+
+    // Order the children along the axis that separates them the most, as flatten() does.
+    aabb left = primitives[start].box, right = primitives[mid].box;
+    for (size_t i = start + 1; i < mid; i++) left = surrounding_box(left, primitives[i].box);
+    for (size_t i = mid + 1; i < end; i++) right = surrounding_box(right, primitives[i].box);
+    vector3 separation = box_centroid(right) - box_centroid(left);
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (fabs(separation[a]) > fabs(separation[axis])) axis = a;
+
+    nodes[index].axis = static_cast<uint8_t>(axis);
+    if (separation[axis] < 0)
+    {
+        build_nodes(nodes, depth, primitives, mid, end, leaf_size, level + 1);
+        nodes[index].offset = static_cast<int32_t>(nodes.size());
+        build_nodes(nodes, depth, primitives, start, mid, leaf_size, level + 1);
+    }
+    else
+    {
+        build_nodes(nodes, depth, primitives, start, mid, leaf_size, level + 1);
+        nodes[index].offset = static_cast<int32_t>(nodes.size());
+        build_nodes(nodes, depth, primitives, mid, end, leaf_size, level + 1);
+    }
+    return index;
+}
+
+inline bool flat_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+    bool hit_anything = false;
+
+    traverse(nodes, depth, r, t_min, t_max, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            if (primitives[i]->hit(r, t_min, closest, rec))
+            {
+                hit_anything = true;
+                closest = rec.t;
+            }
+        }
+        return false;
+    });
+
+    return hit_anything;
+}
+
+inline bool flat_bvh::occluded(const ray& r, double t_min, double t_max) const
+{
+    bool blocked = false;
+
+    traverse(nodes, depth, r, t_min, t_max, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            if (primitives[i]->occluded(r, t_min, closest))
+                return blocked = true;
+        }
+        return false;
+    });
+
+    return blocked;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Scene level owner of shared objects (materials, textures). Primitives and hit records
+// refer to entries by a 32 bit handle, so resolving one during rendering is an index
+// into a vector instead of a shared_ptr copy with its atomic reference count.
+// Entries are only added while the scene is built, lookups are then safe from any thread.
+template <typename T>
+class handle_table {
+public:
+    using handle = uint32_t;
+    static constexpr handle none = ~handle(0);
+
+    // Adding the same object twice returns the same handle. nullptr maps to none.
+    handle add(const std::shared_ptr<T>& item)
+    {
+        if (!item) return none;
+
+        auto found = index.find(item.get());
+        if (found != index.end()) return found->second;
+
+        handle h = static_cast<handle>(entries.size());
+        entries.push_back(item);
+        index.emplace(item.get(), h);
+        return h;
+    }
+
+    const T* operator[](handle h) const
+    {
+        return h == none ? nullptr : entries[h].get();
+    }
+
+    size_t size() const { return entries.size(); }
+
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+    }
+
+private:
+    std::vector<std::shared_ptr<T>> entries;
+    std::unordered_map<const T*, handle> index;
+};
@@ -1,18 +1,29 @@
 #pragma once
+#include <utility>
+
 #include "ray.h"
 #include "ray_trace_engine.h"
 #include "aabb.h"
+#include "handle_table.h"
 
 class material;
+class hittable;
+
+using material_handle = handle_table<material>::handle;
 
+// During traversal primitives only store t and themselves in prim; the shading data
+// (p, normal, material, uv) is filled in by prim->finalize() for the closest hit alone.
 struct hit_record {
     point3 p;
     vector3 normal = vector3(0, 0, 0);
-    shared_ptr<material> mat_ptr;
+    material_handle mat = handle_table<material>::none;
     double t = 0;
     bool front_face = true;
-    double u;
-    double v;
+    real u;
+    real v;
+    const hittable* prim = nullptr;
+    int prim_index = 0; // which element of prim, for primitives that hold several
+    const hittable* instanced_prim = nullptr; // while prim is an instance: what its object hit
 
     inline void set_face_normal(const ray& r, const vector3& outward_normal)
     {
@@ -21,138 +32,60 @@ struct hit_record {
     }
 };
 
+// Camera rays traced together to their first hit. Every ray keeps its own closest hit
+// and its own random stream, which media draw from while they are being hit.
+struct ray_packet {
+    static constexpr int max_size = 64;
+
+    int size = 0;
+    ray rays[max_size];
+    double t_min[max_size]; // surface_t_min of each ray
+    double t_max[max_size];
+    hit_record recs[max_size]; // prim stays nullptr for rays that hit nothing
+    sampler streams[max_size];
+};
+
 class hittable {
 public:
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
-};
 
-class translate : public hittable {
-public:
-    translate(shared_ptr<hittable> p, const vector3& displacement)
-        : ptr(p), offset(displacement)
+    // Resolves the shading data of a hit this object recorded. Objects that fill the
+    // whole record in hit() keep the empty default.
+    virtual void finalize(const ray&, hit_record&) const {}
+
+    // Any hit query for shadow rays: true as soon as something is hit in [t_min, t_max].
+    // The default falls back to hit(); shapes override it to skip the closest hit search
+    // and the hit_record.
+    virtual bool occluded(const ray& r, double t_min, double t_max) const
     {
+        hit_record rec;
+        return hit(r, t_min, t_max, rec);
     }
 
-    virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
-
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
-
-public:
-    shared_ptr<hittable> ptr;
-    vector3 offset;
-};
-
-inline bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
-    if (!ptr->hit(moved_r, t_min, t_max, rec))
-        return false;
-
-    rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
-
-    return true;
-}
-
-inline bool translate::bounding_box(double time0, double time1, aabb& output_box) const
-{
-    if (!ptr->bounding_box(time0, time1, output_box))
-        return false;
+    // Light sampling hooks. random(o) picks a direction from o towards the shape and
+    // pdf_value(o, v) is the solid angle density of picking v that way. Shapes that cannot
+    // be sampled keep the defaults and are never used as lights.
+    virtual double pdf_value(const point3&, const vector3&) const { return 0.0; }
+    virtual vector3 random(const point3&) const { return vector3(1, 0, 0); }
 
-    output_box = aabb(
-        output_box.minim() + offset,
-        output_box.maxim() + offset);
+    // True for shapes that emit light and can be sampled towards.
+    virtual bool is_light() const { return false; }
 
-    return true;
-}
-
-class rotate_y : public hittable {
-public:
-    rotate_y(shared_ptr<hittable> p, double angle);
-
-    virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
-
-    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+    // Closest hits for a whole packet, shrinking each ray's t_max like hit() does. The
+    // default traces the rays one by one; acceleration structures share the traversal.
+    virtual void hit_packet(ray_packet& packet) const
     {
-        output_box = bbox;
-        return hasbox;
+        for (int k = 0; k < packet.size; k++)
+            hit_packet_ray(packet, k);
     }
 
-public:
-    shared_ptr<hittable> ptr;
-    double sin_theta;
-    double cos_theta;
-    bool hasbox;
-    aabb bbox;
-};
-
-inline rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p)
-{
-    auto radians = degrees_to_radians(angle);
-    sin_theta = sin(radians);
-    cos_theta = cos(radians);
-    hasbox = ptr->bounding_box(0, 1, bbox);
-
-    point3 minim(infinity, infinity, infinity);
-    point3 maxim(-infinity, -infinity, -infinity);
-
-    for (int i = 0; i < 2; i++)
+    // Ray k of the packet against this object alone, with ray k's random stream.
+    void hit_packet_ray(ray_packet& packet, int k) const
     {
-        for (int j = 0; j < 2; j++)
-        {
-            for (int k = 0; k < 2; k++)
-            {
-                auto x = i * bbox.maxim().x() + (1 - i) * bbox.minim().x();
-                auto y = j * bbox.maxim().y() + (1 - j) * bbox.minim().y();
-                auto z = k * bbox.maxim().z() + (1 - k) * bbox.minim().z();
-
-                auto newx = cos_theta * x + sin_theta * z;
-                auto newz = -sin_theta * x + cos_theta * z;
-
-                vector3 tester(newx, y, newz);
-
-                for (int c = 0; c < 3; c++)
-                {
-                    minim[c] = fmin(minim[c], tester[c]);
-                    maxim[c] = fmax(maxim[c], tester[c]);
-                }
-            }
-        }
+        std::swap(thread_sampler, packet.streams[k]);
+        if (hit(packet.rays[k], packet.t_min[k], packet.t_max[k], packet.recs[k]))
+            packet.t_max[k] = packet.recs[k].t;
+        std::swap(thread_sampler, packet.streams[k]);
     }
-
-    bbox = aabb(minim, maxim);
-}
-
-inline bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
-{
-    auto origin = r.origin();
-    auto direction = r.direction();
-
-    origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-    origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-    direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-    direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-    ray rotated_r(origin, direction, r.time());
-
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
-        return false;
-
-    auto p = rec.p;
-    auto normal = rec.normal;
-
-    p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
-    p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
-
-    normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
-    normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
-
-    rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
-
-    return true;
-}
\ No newline at end of file
+};
@@ -18,6 +18,12 @@ public:
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+    virtual void hit_packet(ray_packet& packet) const override;
+
+    // Used as a light list: picks one member uniformly, so the density is their average.
+    virtual double pdf_value(const point3& o, const vector3& v) const override;
+    virtual vector3 random(const point3& o) const override;
 
 public:
     std::vector<shared_ptr<hittable>> objects;
@@ -25,23 +31,40 @@ public:
 
 inline bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
 {
-    hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
+    // Objects only write rec when they hit, and only t and prim at that, so the
+    // closest candidate can be recorded in place.
     for (const auto& object : objects)
     {
-        if (object->hit(r, t_min, closest_so_far, temp_rec))
+        if (object->hit(r, t_min, closest_so_far, rec))
         {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
     return hit_anything;
 }
 
+inline bool hittable_list::occluded(const ray& r, double t_min, double t_max) const
+{
+    for (const auto& object : objects)
+    {
+        if (object->occluded(r, t_min, t_max))
+            return true;
+    }
+
+    return false;
+}
+
+inline void hittable_list::hit_packet(ray_packet& packet) const
+{
+    for (const auto& object : objects)
+        object->hit_packet(packet);
+}
+
 inline bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const
 {
     if (objects.empty()) return false;
@@ -57,4 +80,23 @@ inline bool hittable_list::bounding_box(double time0, double time1, aabb& output
     }
 
     return true;
+}
+
+inline double hittable_list::pdf_value(const point3& o, const vector3& v) const
+{
+    if (objects.empty()) return 0.0;
+
+    auto weight = 1.0 / objects.size();
+    auto sum = 0.0;
+
+    for (const auto& object : objects)
+        sum += weight * object->pdf_value(o, v);
+
+    return sum;
+}
+
+inline vector3 hittable_list::random(const point3& o) const
+{
+    auto int_size = static_cast<int>(objects.size());
+    return objects[random_int(0, int_size - 1)]->random(o);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "vector3.h"
+#include "film.h"
 
 class image
 {
@@ -15,6 +16,19 @@ public:
 
     int samples_per_pixel = 16;
     int max_depth = 16;
+    int rr_start_depth = 3;
+    bool light_sampling = true;
+
+    int tile_size = 32;
+    int packet_size = 0;        // camera rays traced in packet_size x packet_size bundles, 0 = one by one
+    bool wavefront = false;     // integrator = wavefront: whole batches of paths, one stage at a time
+
+    int samples_per_pass = 0;   // 0 = every sample in a single pass
+    double time_budget = 0;     // seconds, 0 = no limit
+
+    adaptive_settings adaptive;
+    bool sample_heatmap = false;
+    const char* heatmapImg = "sample_heatmap.png";
 
     const char* pngImg = "render.png";
     #pragma endregion
@@ -0,0 +1,412 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "hittable.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+
+// A 3x4 affine transform, p' = m p + t.
+struct affine_transform {
+    double m[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+    vector3 t = vector3(0, 0, 0);
+
+    static affine_transform translation(const vector3& offset)
+    {
+        affine_transform a;
+        a.t = offset;
+        return a;
+    }
+
+    static affine_transform scaling(const vector3& factors)
+    {
+        affine_transform a;
+        for (int i = 0; i < 3; i++)
+            a.m[i][i] = factors[i];
+        return a;
+    }
+
+    static affine_transform rotation_y(double angle)
+    {
+        auto radians = degrees_to_radians(angle);
+        affine_transform a;
+        a.m[0][0] = a.m[2][2] = cos(radians);
+        a.m[0][2] = sin(radians);
+        a.m[2][0] = -a.m[0][2];
+        return a;
+    }
+
+    // Rotation by angle degrees around axis, counterclockwise looking down the axis.
+    static affine_transform rotation(const vector3& axis, double angle)
+    {
+        vector3 n = unit_vector(axis);
+        auto radians = degrees_to_radians(angle);
+        double c = cos(radians), s = sin(radians);
+        affine_transform a;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                a.m[i][j] = (1 - c) * n[i] * n[j] + (i == j ? c : 0);
+        a.m[0][1] -= s * n[2]; a.m[1][0] += s * n[2];
+        a.m[0][2] += s * n[1]; a.m[2][0] -= s * n[1];
+        a.m[1][2] -= s * n[0]; a.m[2][1] += s * n[0];
+        return a;
+    }
+
+    vector3 vector(const vector3& v) const
+    {
+        return vector3(
+            m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+            m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+            m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    point3 point(const point3& p) const { return vector(p) + t; }
+
+    // Multiplies by the transposed linear part. Applied to a world to object transform this
+    // takes an object space normal to world space.
+    vector3 transposed(const vector3& n) const
+    {
+        return vector3(
+            m[0][0] * n[0] + m[1][0] * n[1] + m[2][0] * n[2],
+            m[0][1] * n[0] + m[1][1] * n[1] + m[2][1] * n[2],
+            m[0][2] * n[0] + m[1][2] * n[1] + m[2][2] * n[2]);
+    }
+
+    ray apply(const ray& r) const { return ray(point(r.origin()), vector(r.direction()), r.time()); }
+
+    // This transform applied after b.
+    affine_transform operator*(const affine_transform& b) const
+    {
+        affine_transform a;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                a.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j];
+        a.t = point(b.t);
+        return a;
+    }
+
+    affine_transform inverse() const
+    {
+        affine_transform a;
+        a.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        a.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+        a.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+        a.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        a.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+        a.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+        a.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        a.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+        a.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+        double inv_det = 1 / (m[0][0] * a.m[0][0] + m[0][1] * a.m[1][0] + m[0][2] * a.m[2][0]);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                a.m[i][j] *= inv_det;
+        a.t = -a.vector(t);
+        return a;
+    }
+
+    // Bounds of the transformed corners of b.
+    aabb box(const aabb& b) const
+    {
+        point3 minim(infinity, infinity, infinity);
+        point3 maxim(-infinity, -infinity, -infinity);
+        for (int corner = 0; corner < 8; corner++)
+        {
+            point3 p(
+                corner & 1 ? b.maxim().x() : b.minim().x(),
+                corner & 2 ? b.maxim().y() : b.minim().y(),
+                corner & 4 ? b.maxim().z() : b.minim().z());
+            p = point(p);
+            for (int c = 0; c < 3; c++)
+            {
+                minim[c] = fmin(minim[c], p[c]);
+                maxim[c] = fmax(maxim[c], p[c]);
+            }
+        }
+        return aabb(minim, maxim);
+    }
+};
+
+// Brings the hit an object recorded for the object space ray local back to world space.
+// object_prim, the primitive the object's hit() recorded, resolves it in object space (null
+// when that was already done). The point is taken from the world ray, the normal goes
+// through the transposed world to object transform; the face side does not change under
+// an affine map.
+inline void resolve_instance_hit(const hittable* object_prim, const affine_transform& to_object,
+    const ray& r, const ray& local, hit_record& rec)
+{
+    if (object_prim)
+        object_prim->finalize(local, rec);
+    rec.p = r.at(rec.t);
+    rec.normal = unit_vector(to_object.transposed(rec.normal));
+}
+
+// A shared object placed in the world by an affine transform. Rays are taken to the
+// object's own space, so the object (typically a whole BVH) is stored once however many
+// instances use it. Instances of instances are folded into one transform on construction.
+class instance : public hittable {
+public:
+    instance(shared_ptr<hittable> object, const affine_transform& to_world)
+        : instance(object, to_world, to_world.inverse())
+    {
+    }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override
+    {
+        if (!object->bounding_box(time0, time1, output_box))
+            return false;
+        output_box = to_world.box(output_box);
+        return true;
+    }
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        return object->occluded(to_object.apply(r), t_min, t_max);
+    }
+
+protected:
+    // For transforms whose inverse is known exactly.
+    instance(shared_ptr<hittable> p, const affine_transform& world, const affine_transform& inverse)
+        : object(p), to_world(world), to_object(inverse)
+    {
+        if (auto inner = dynamic_cast<const instance*>(object.get()))
+        {
+            to_world = to_world * inner->to_world;
+            to_object = inner->to_object * to_object;
+            object = inner->object;
+        }
+    }
+
+public:
+    shared_ptr<hittable> object;
+    affine_transform to_world;
+    affine_transform to_object;
+};
+
+inline bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+    ray local = to_object.apply(r);
+    const hittable* earlier = rec.instanced_prim;
+    rec.instanced_prim = nullptr;
+    if (!object->hit(local, t_min, t_max, rec))
+    {
+        rec.instanced_prim = earlier;
+        return false;
+    }
+
+    // Only the closest hit is resolved, in finalize(). An object that holds instances of its
+    // own may have left one of them pending; there is room for one only, so that one is
+    // resolved now, in object space.
+    if (rec.instanced_prim)
+    {
+        rec.prim->finalize(local, rec);
+        rec.instanced_prim = nullptr;
+    }
+    else
+    {
+        rec.instanced_prim = rec.prim;
+    }
+    rec.prim = this;
+    return true;
+}
+
+inline void instance::finalize(const ray& r, hit_record& rec) const
+{
+    // The object's hit has to be resolved with the ray in its own space.
+    const hittable* object_prim = rec.instanced_prim;
+    rec.instanced_prim = nullptr;
+    resolve_instance_hit(object_prim, to_object, r, to_object.apply(r), rec);
+}
+
+class translate : public instance {
+public:
+    translate(shared_ptr<hittable> p, const vector3& displacement)
+        : instance(p, affine_transform::translation(displacement), affine_transform::translation(-displacement))
+    {
+    }
+};
+
+class rotate_y : public instance {
+public:
+    rotate_y(shared_ptr<hittable> p, double angle)
+        : instance(p, affine_transform::rotation_y(angle), affine_transform::rotation_y(-angle))
+    {
+    }
+};
+
+// A top level BVH over many instances of a few shared objects. Each instance is a 64 byte
+// record: the world to object transform, with the linear part in floats and the translation
+// in doubles, and the index of its object. Forward transforms are never needed: hit points
+// come from the world ray and normals from the transposed inverse.
+class instance_set : public hittable {
+public:
+    static constexpr int leaf_size = 2;
+
+    // Instances are bounded over the shutter interval [time0, time1].
+    instance_set(double time0 = 0, double time1 = 1) : time0(time0), time1(time1) {}
+
+    // Places one more instance of object. Objects placed several times are stored once.
+    void add(shared_ptr<hittable> object, const affine_transform& to_world);
+
+    // Builds the top level BVH. Call once, after the last add().
+    void build();
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+    virtual bool bounding_box(double, double, aabb& output_box) const override
+    {
+        output_box = box;
+        return !nodes.empty();
+    }
+
+    size_t instance_count() const { return records.size(); }
+    size_t object_count() const { return objects.size(); }
+
+    // Bytes of the instance records and the top level BVH; the shared objects are not counted.
+    size_t memory_bytes() const
+    {
+        return records.capacity() * sizeof(record) + nodes.capacity() * sizeof(flat_bvh_node)
+            + objects.capacity() * sizeof(shared_ptr<hittable>);
+    }
+
+private:
+    struct record {
+        float m[3][3];
+        uint32_t object;
+        double t[3];
+
+        affine_transform to_object() const
+        {
+            affine_transform a;
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    a.m[i][j] = m[i][j];
+            a.t = vector3(t[0], t[1], t[2]);
+            return a;
+        }
+    };
+
+    static_assert(sizeof(record) == 64, "instance records must stay 64 bytes");
+
+public:
+    std::vector<shared_ptr<hittable>> objects;
+    aabb box;
+    int depth = 0;
+    double time0, time1;
+
+private:
+    std::vector<record> records;
+    std::vector<flat_bvh_node> nodes;
+
+    // Only needed until build().
+    std::unordered_map<const hittable*, uint32_t> object_indices;
+    std::vector<aabb> boxes;
+};
+
+inline void instance_set::add(shared_ptr<hittable> object, const affine_transform& to_world)
+{
+    auto found = object_indices.find(object.get());
+    uint32_t index = found != object_indices.end() ? found->second : static_cast<uint32_t>(objects.size());
+    if (index == objects.size())
+    {
+        object_indices.emplace(object.get(), index);
+        objects.push_back(object);
+    }
+
+    affine_transform inverse = to_world.inverse();
+    record rec;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            rec.m[i][j] = static_cast<float>(inverse.m[i][j]);
+        rec.t[i] = inverse.t[i];
+    }
+    rec.object = index;
+    records.push_back(rec);
+
+    // Bound the transform the rounded record actually applies, not the one asked for.
+    aabb object_box;
+    object->bounding_box(time0, time1, object_box);
+    boxes.push_back(rec.to_object().inverse().box(object_box));
+}
+
+inline void instance_set::build()
+{
+    size_t count = records.size();
+    if (count == 0)
+        return;
+
+    std::vector<bvh_build_primitive> primitives(count);
+    for (size_t i = 0; i < count; i++)
+        primitives[i] = { boxes[i], box_centroid(boxes[i]), i };
+
+    nodes.reserve(2 * count / leaf_size + 1);
+    flat_bvh::build_nodes(nodes, depth, primitives, 0, count, leaf_size);
+    nodes.shrink_to_fit();
+    box = aabb(
+        point3(nodes[0].bounds_min[0], nodes[0].bounds_min[1], nodes[0].bounds_min[2]),
+        point3(nodes[0].bounds_max[0], nodes[0].bounds_max[1], nodes[0].bounds_max[2]));
+
+    // Store the records in leaf order, so every leaf is one contiguous range.
+    std::vector<record> sorted(count);
+    for (size_t i = 0; i < count; i++)
+        sorted[i] = records[primitives[i].index];
+    records.swap(sorted);
+
+    boxes = std::vector<aabb>();
+    object_indices = std::unordered_map<const hittable*, uint32_t>();
+}
+
+inline bool instance_set::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+    int closest_instance = -1;
+
+    flat_bvh::traverse(nodes, depth, r, t_min, t_max, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            ray local = records[i].to_object().apply(r);
+            if (objects[records[i].object]->hit(local, t_min, closest, rec))
+            {
+                closest_instance = i;
+                closest = rec.t;
+            }
+        }
+        return false;
+    });
+
+    if (closest_instance < 0)
+        return false;
+
+    // Only the closest instance's hit is resolved, once the whole tree has been walked.
+    affine_transform to_object = records[closest_instance].to_object();
+    const hittable* object_prim = rec.prim;
+    resolve_instance_hit(object_prim, to_object, r, to_object.apply(r), rec);
+    rec.prim = this;
+    rec.instanced_prim = nullptr;
+    return true;
+}
+
+inline bool instance_set::occluded(const ray& r, double t_min, double t_max) const
+{
+    bool blocked = false;
+
+    flat_bvh::traverse(nodes, depth, r, t_min, t_max, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            if (objects[records[i].object]->occluded(records[i].to_object().apply(r), t_min, closest))
+                return blocked = true;
+        }
+        return false;
+    });
+
+    return blocked;
+}
@@ -2,6 +2,7 @@
 
 #include "ray_trace_engine.h"
 #include "hittable.h"
+#include "sampling.h"
 #include "texture.h"
 
 struct hit_record; // Forward declaration of hit_record
@@ -16,12 +17,21 @@ public:
     {
         return color(0, 0, 0);
     }
+
+    // Solid angle density with which scatter picks the direction of scattered.
+    // 0 for specular materials, whose single direction light sampling can never find.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const
+    {
+        return 0;
+    }
+
+    virtual bool is_emissive() const { return false; }
 };
 
 class lambertian : public material {
 public:
-    lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
-    lambertian(shared_ptr<texture> a) : albedo(a) {}
+    lambertian(const color& a) : lambertian(make_shared<solid_color>(a)) {}
+    lambertian(shared_ptr<texture> a) : albedo(scene_textures.add(a)) {}
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
@@ -34,12 +44,18 @@ public:
             scatter_direction = rec.normal;
 
         scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        attenuation = scene_textures[albedo]->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    // normal + random_unit_vector() is cosine distributed.
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+    {
+        return cosine_hemisphere_pdf(dot(rec.normal, unit_vector(scattered.direction())));
+    }
+
 public:
-    shared_ptr<texture> albedo;
+    texture_handle albedo;
 };
 
 class metal : public material {
@@ -122,14 +138,19 @@ public:
         attenuation = normal_color + albedo;
         return true;
     }
+
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+    {
+        return cosine_hemisphere_pdf(dot(rec.normal, unit_vector(scattered.direction())));
+    }
 public:
     color albedo;
 };
 
 class diffuse_light : public material {
 public:
-    diffuse_light(shared_ptr<texture> a) : emit(a) {}
-    diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+    diffuse_light(shared_ptr<texture> a) : emit(scene_textures.add(a)) {}
+    diffuse_light(color c) : diffuse_light(make_shared<solid_color>(c)) {}
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
@@ -140,27 +161,37 @@ public:
 
     virtual color emitted(double u, double v, const point3& p) const override
     {
-        return emit->value(u, v, p);
+        return scene_textures[emit]->value(u, v, p);
     }
 
+    virtual bool is_emissive() const override { return true; }
+
 public:
-    shared_ptr<texture> emit;
+    texture_handle emit;
 };
 
 class isotropic : public material {
 public:
-    isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
-    isotropic(shared_ptr<texture> a) : albedo(a) {}
+    isotropic(color c) : isotropic(make_shared<solid_color>(c)) {}
+    isotropic(shared_ptr<texture> a) : albedo(scene_textures.add(a)) {}
 
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override
     {
-        scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        scattered = ray(rec.p, random_unit_vector(), r_in.time());
+        attenuation = scene_textures[albedo]->value(rec.u, rec.v, rec.p);
         return true;
     }
 
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override
+    {
+        return uniform_sphere_pdf();
+    }
+
 public:
-    shared_ptr<texture> albedo;
+    texture_handle albedo;
 };
+
+// Every material referenced by the loaded scene. Primitives keep handles into it.
+inline handle_table<material> scene_materials;
\ No newline at end of file
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "hittable.h"
+#include "material.h"
 #include "ray_trace_engine.h"
 #include "aabb.h"
 
@@ -9,20 +10,22 @@ public:
     moving_sphere() {}
     moving_sphere(
         point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m)
-        : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m)
+        : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat(scene_materials.add(m))
     {
     };
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
     virtual bool bounding_box(double _time0, double _time1, aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
     point3 center(double time) const;
 
 public:
     point3 center0, center1;
     double time0, time1;
-    double radius;
-    shared_ptr<material> mat_ptr;
+    real radius;
+    material_handle mat = handle_table<material>::none;
 };
 
 inline point3 moving_sphere::center(double time) const
@@ -51,12 +54,34 @@ inline bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_rec
     }
 
     rec.t = root;
+    rec.prim = this;
+
+    return true;
+}
+
+inline void moving_sphere::finalize(const ray& r, hit_record& rec) const
+{
     rec.p = r.at(rec.t);
     auto outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat = mat;
+}
 
-    return true;
+inline bool moving_sphere::occluded(const ray& r, double t_min, double t_max) const
+{
+    vector3 oc = r.origin() - center(r.time());
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    auto root = (-half_b - sqrtd) / a;
+    if (root >= t_min && root <= t_max) return true;
+    root = (-half_b + sqrtd) / a;
+    return root >= t_min && root <= t_max;
 }
 
 bool moving_sphere::bounding_box(double _time0, double _time1, aabb& output_box) const
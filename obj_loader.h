@@ -0,0 +1,233 @@
+#pragma once
+
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "triangle_mesh.h"
+
+// Streaming Wavefront OBJ reader for the geometry records: v, vn, vt and f. Polygons are
+// fanned into triangles and negative indices count back from the last vertex; groups,
+// materials and smoothing groups are skipped. The file is read in large blocks and parsed
+// in place with std::from_chars, so multi-million triangle files load in seconds.
+class obj_loader {
+public:
+    // Loads file_name into data, scaling the vertices by scale and then moving them by
+    // offset. Prints the reason and returns false when the file cannot be used.
+    static bool load(const std::string& file_name, triangle_mesh_data& data, double scale = 1, const vector3& offset = vector3(0, 0, 0))
+    {
+        std::ifstream file(file_name, std::ios::binary);
+        if (!file)
+        {
+            std::cerr << "Error opening mesh file: " << file_name << std::endl;
+            return false;
+        }
+
+        obj_loader loader(data, scale, offset);
+
+        // Lines that straddle two blocks are carried over to the next one.
+        const size_t block_size = 1 << 20;
+        std::vector<char> buffer(block_size);
+        size_t carried = 0;
+        while (true)
+        {
+            if (carried == buffer.size())
+                buffer.resize(buffer.size() * 2);
+
+            file.read(buffer.data() + carried, buffer.size() - carried);
+            size_t available = carried + static_cast<size_t>(file.gcount());
+            bool last_block = !file;
+
+            const char* begin = buffer.data();
+            const char* end = begin + available;
+            const char* line = begin;
+            while (true)
+            {
+                const char* newline = static_cast<const char*>(std::memchr(line, '\n', end - line));
+                if (!newline && !last_block)
+                    break;
+                const char* line_end = newline ? newline : end;
+                if (!loader.parse_line(line, line_end))
+                {
+                    std::cerr << "Error in mesh file " << file_name << " at line " << loader.line_number << std::endl;
+                    return false;
+                }
+                if (!newline)
+                    break;
+                line = newline + 1;
+            }
+
+            if (last_block)
+                break;
+            carried = end - line;
+            std::copy(line, end, buffer.data());
+        }
+
+        if (data.triangle_count() == 0)
+        {
+            std::cerr << "No triangles in mesh file: " << file_name << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    obj_loader(triangle_mesh_data& data, double scale, const vector3& offset)
+        : data(data), scale(scale), offset(offset)
+    {
+    }
+
+    // One corner of a face: indices into the vertex arrays, none when absent.
+    struct corner {
+        uint32_t vertex;
+        uint32_t uv = triangle_mesh_data::none;
+        uint32_t normal = triangle_mesh_data::none;
+    };
+
+    static const char* skip_spaces(const char* p, const char* end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+        return p;
+    }
+
+    static const char* parse_double(const char* p, const char* end, double& value)
+    {
+        p = skip_spaces(p, end);
+        if (p < end && *p == '+')
+            p++;
+        auto result = std::from_chars(p, end, value);
+        return result.ec == std::errc() ? result.ptr : nullptr;
+    }
+
+    // OBJ indices start at 1; negative ones are relative to the current end of the array.
+    static bool resolve_index(long long index, size_t count, uint32_t& resolved)
+    {
+        long long absolute = index > 0 ? index - 1 : static_cast<long long>(count) + index;
+        if (index == 0 || absolute < 0 || absolute >= static_cast<long long>(count))
+            return false;
+        resolved = static_cast<uint32_t>(absolute);
+        return true;
+    }
+
+    const char* parse_corner(const char* p, const char* end, corner& c) const
+    {
+        long long index;
+        auto result = std::from_chars(p, end, index);
+        if (result.ec != std::errc() || !resolve_index(index, data.positions.size(), c.vertex))
+            return nullptr;
+        p = result.ptr;
+
+        if (p < end && *p == '/')
+        {
+            p++;
+            if (p < end && *p != '/')
+            {
+                result = std::from_chars(p, end, index);
+                if (result.ec != std::errc() || !resolve_index(index, data.uvs.size() / 2, c.uv))
+                    return nullptr;
+                p = result.ptr;
+            }
+            if (p < end && *p == '/')
+            {
+                p++;
+                result = std::from_chars(p, end, index);
+                if (result.ec != std::errc() || !resolve_index(index, data.normals.size(), c.normal))
+                    return nullptr;
+                p = result.ptr;
+            }
+        }
+        return p;
+    }
+
+    // Appends one triangle. The optional index arrays are only created once some corner
+    // needs them, then padded for the triangles before it.
+    void add_triangle(const corner& a, const corner& b, const corner& c)
+    {
+        size_t filled = data.vertex_indices.size();
+        data.vertex_indices.insert(data.vertex_indices.end(), { a.vertex, b.vertex, c.vertex });
+
+        bool has_uv = a.uv != triangle_mesh_data::none || b.uv != triangle_mesh_data::none || c.uv != triangle_mesh_data::none;
+        if (has_uv || !data.uv_indices.empty())
+        {
+            data.uv_indices.resize(filled, triangle_mesh_data::none);
+            data.uv_indices.insert(data.uv_indices.end(), { a.uv, b.uv, c.uv });
+        }
+
+        bool has_normal = a.normal != triangle_mesh_data::none || b.normal != triangle_mesh_data::none || c.normal != triangle_mesh_data::none;
+        if (has_normal || !data.normal_indices.empty())
+        {
+            data.normal_indices.resize(filled, triangle_mesh_data::none);
+            data.normal_indices.insert(data.normal_indices.end(), { a.normal, b.normal, c.normal });
+        }
+    }
+
+    bool parse_line(const char* p, const char* end)
+    {
+        line_number++;
+        p = skip_spaces(p, end);
+        if (p == end || (*p != 'v' && *p != 'f'))
+            return true;
+
+        if (*p == 'f' && p + 1 < end && (p[1] == ' ' || p[1] == '\t'))
+        {
+            corner first, previous, current;
+            int corners = 0;
+            p = skip_spaces(p + 1, end);
+            while (p < end)
+            {
+                current = corner();
+                p = parse_corner(p, end, current);
+                if (!p)
+                    return false;
+                if (corners == 0)
+                    first = current;
+                else if (corners >= 2)
+                    add_triangle(first, previous, current);
+                previous = current;
+                corners++;
+                p = skip_spaces(p, end);
+            }
+            return corners >= 3;
+        }
+
+        if (*p != 'v' || p + 1 >= end)
+            return true;
+
+        double x, y, z;
+        if (p[1] == ' ' || p[1] == '\t')
+        {
+            if (!(p = parse_double(p + 1, end, x)) || !(p = parse_double(p, end, y)) || !(p = parse_double(p, end, z)))
+                return false;
+            data.positions.push_back(scale * point3(x, y, z) + offset);
+        }
+        else if (p[1] == 'n')
+        {
+            if (!(p = parse_double(p + 2, end, x)) || !(p = parse_double(p, end, y)) || !(p = parse_double(p, end, z)))
+                return false;
+            data.normals.push_back(vector3(x, y, z));
+        }
+        else if (p[1] == 't')
+        {
+            // v is optional (one dimensional textures), and so is a third coordinate.
+            if (!(p = parse_double(p + 2, end, x)))
+                return false;
+            y = 0;
+            if (skip_spaces(p, end) < end && !(p = parse_double(p, end, y)))
+                return false;
+            data.uvs.push_back(x);
+            data.uvs.push_back(y);
+        }
+        return true;
+    }
+
+private:
+    triangle_mesh_data& data;
+    double scale;
+    vector3 offset;
+    size_t line_number = 0;
+};
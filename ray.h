@@ -1,16 +1,31 @@
 #pragma once
+
+#include <limits>
+#include <type_traits>
+
 #include "vector3.h"
 
+// The reciprocal of the direction is worked out once per ray, since every box test of a
+// traversal needs it.
 class ray {
 public:
     ray() {};
-    ray(const point3& origin, const vector3& direction, double time = 0.0)
-        : orig(origin), dir(direction), tm(time)
-    {}
+    ray(const point3& origin, const vector3& direction, real time = 0)
+        : orig(origin), dir(direction), tm(time),
+        inv_dir(1 / direction.x(), 1 / direction.y(), 1 / direction.z())
+    {
+    }
 
     point3 origin() const { return orig; }
     vector3 direction() const { return dir; }
-    double time() const { return tm; }
+    real time() const { return tm; }
+
+    // Infinite along axes the ray is parallel to.
+    const vector3& inverse_direction() const { return inv_dir; }
+
+    // 1 along axes the ray travels towards negative values (including -0), where it enters
+    // a slab through its maximum.
+    int direction_sign(int axis) const { return inv_dir[axis] < 0; }
 
     point3 at(double t) const
     {
@@ -20,5 +35,29 @@ public:
 public:
     point3 orig;
     vector3 dir;
-    double tm;
-};
\ No newline at end of file
+    real tm;
+    vector3 inv_dir;
+};
+
+// Nearest distance a ray leaving a surface accepts a hit at, so the rounding error of the
+// hit point it starts from cannot find that surface again. The fixed 0.001 suits the scale
+// of our scenes; the second term grows with the origin's largest coordinate, in units of
+// real's precision, so float builds stay clean far from the origin. It is divided by the
+// largest direction component (through the cached reciprocal) rather than the length,
+// which is at most sqrt(3) more cautious and saves a square root and a division per ray.
+// Doubles would need coordinates past 1e10 for the term to matter, so they skip it.
+inline double surface_t_min(const ray& r)
+{
+    if constexpr (std::is_same_v<real, double>)
+    {
+        return 0.001;
+    }
+    else
+    {
+        const point3& o = r.orig;
+        const vector3& inv_d = r.inv_dir;
+        double extent = fmax(fabs(o.x()), fmax(fabs(o.y()), fabs(o.z())));
+        double inv_length = fmin(fabs(inv_d.x()), fmin(fabs(inv_d.y()), fabs(inv_d.z())));
+        return 0.001 + extent * inv_length * (64 * std::numeric_limits<real>::epsilon());
+    }
+}
@@ -5,11 +5,22 @@
 #include <memory>
 #include <cstdlib>
 
+#include "sampler.h"
+
 // Usings
 using std::shared_ptr;
 using std::make_shared;
 using std::sqrt;
 
+// Scalar type of the math core. Builds defining RT_SINGLE_PRECISION keep vectors, rays, hit
+// points and primitive geometry in floats, halving the memory of meshes and path state;
+// hit distances, the SIMD sphere and box leaves and the film sums stay double either way.
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
 // Constants
 const double infinity = std::numeric_limits<double>::infinity();
 const double pi = 3.1415926535897932385;
@@ -22,8 +33,8 @@ inline double degrees_to_radians(double degrees)
 
 inline double random_double()
 {
-    // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1), drawn from this thread's sample stream.
+    return thread_sampler.next_double();
 }
 
 inline double random_double(double min, double max)
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <cstdint>
+
+#include "sobol.h"
+#include "blue_noise.h"
+
+// Counter based random numbers for the renderer.
+// Every value is a pure function of (seed, pixel, sample, bounce, counter), so there is no
+// state shared between render threads and a seeded render is identical no matter how
+// many threads traced it or in which order the tiles were picked up.
+
+inline uint64_t mix64(uint64_t z)
+{
+    // SplitMix64 finalizer, a cheap bijective 64 bit hash.
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Where the numbers drawn for camera samples come from. The counter of a bounce is its
+// dimension: the low discrepancy sequences give dimension d of sample s of a pixel a value
+// that, over the pixel's samples, fills [0, 1) far more evenly than independent draws.
+enum class sample_sequence {
+    independent, // hashed white noise
+    sobol,       // Owen scrambled Sobol points, scrambled differently in every pixel
+    blue_noise   // one Owen scrambled Sobol sequence, shifted per pixel by a blue noise mask
+};
+
+class sampler {
+public:
+    // Stream used while building scenes (random_scene, perlin permutations, ...).
+    // Always independent.
+    void start_scene()
+    {
+        start_pixel_sample(scene_pixel, 0, 0, 0);
+    }
+
+    // Called once per camera sample, before the pixel jitter and the camera ray are drawn.
+    // (x, y) locates the pixel for the blue noise mask.
+    void start_pixel_sample(uint64_t pixel_index, uint64_t sample_index, uint32_t x, uint32_t y)
+    {
+        pixel = pixel_index;
+        sample = sample_index;
+        pixel_x = x;
+        pixel_y = y;
+        start_bounce(0);
+    }
+
+    // Rekeys the stream for the given bounce of the current path.
+    void start_bounce(uint32_t bounce_index)
+    {
+        bounce = bounce_index;
+        key = mix64(seed ^ mix64(pixel ^ mix64(sample ^ mix64(bounce + golden))));
+        counter = 0;
+
+        // Blue noise shares the scrambling between pixels, so their errors only differ by
+        // the mask's offsets.
+        if (sequence != sample_sequence::independent)
+        {
+            uint64_t scramble_pixel = sequence == sample_sequence::blue_noise ? 0 : pixel;
+            sequence_key = mix64(~seed ^ mix64(scramble_pixel ^ mix64(bounce + golden)));
+        }
+    }
+
+    void next_bounce() { start_bounce(bounce + 1); }
+
+    uint64_t next_u64()
+    {
+        return mix64(key + ++counter * golden);
+    }
+
+    // Returns a random real in [0,1).
+    double next_double()
+    {
+        if (sequence == sample_sequence::independent || pixel == scene_pixel)
+            return (next_u64() >> 11) * (1.0 / 9007199254740992.0);
+        return next_low_discrepancy();
+    }
+
+public:
+    static inline uint64_t seed = 0;
+    static inline sample_sequence sequence = sample_sequence::independent;
+
+private:
+    static constexpr uint64_t golden = 0x9e3779b97f4a7c15ull;
+    static constexpr uint64_t scene_pixel = ~0ull;
+
+    uint64_t pixel = scene_pixel;
+    uint64_t sample = 0;
+    uint32_t bounce = 0;
+    uint32_t pixel_x = 0, pixel_y = 0;
+    uint64_t key = 0;
+    uint64_t sequence_key = 0;
+    uint64_t counter = 0;
+    double pair_second = 0;
+
+    // Dimensions are taken in pairs, each pair a 2D Sobol pattern with its own shuffle and
+    // scramble (see sobol.h). Both values are made on the even dimension and the second one
+    // is kept for the odd one.
+    double next_low_discrepancy()
+    {
+        uint64_t dimension = counter++;
+        if (dimension & 1)
+            return pair_second;
+
+        uint64_t pair_seed = mix64(sequence_key + (dimension >> 1) * golden);
+        uint32_t x, y;
+        shuffled_scrambled_sobol(static_cast<uint32_t>(sample), pair_seed, x, y);
+
+        if (sequence == sample_sequence::blue_noise)
+        {
+            // Both values read the mask at their own toroidal offset, different for every
+            // pair, so the dimensions of a pixel are not shifted alike. Fixed point addition
+            // wraps around [0, 1).
+            const blue_noise_mask& mask = blue_noise_mask::get();
+            uint32_t ox = static_cast<uint32_t>(pair_seed >> 20), oy = static_cast<uint32_t>(pair_seed >> 40);
+            x += mask.value(pixel_x + ox, pixel_y + oy);
+            y += mask.value(pixel_x + oy, pixel_y + ox + blue_noise_mask::size / 2);
+        }
+        pair_second = y * (1.0 / 4294967296.0);
+        double u = x * (1.0 / 4294967296.0);
+        return u;
+    }
+};
+
+inline thread_local sampler thread_sampler;
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cmath>
+
+#include "ray_trace_engine.h"
+#include "vector3.h"
+
+// Closed form warps from uniform numbers in [0,1) to the distributions the materials, media
+// and camera sample. Each takes a fixed number of numbers (its dimensions), with no
+// rejection loop, so a path always draws the same count per bounce and a stratified or
+// low discrepancy source can be plugged in dimension by dimension.
+// Directions are around +Z; onb::local takes them to world space.
+
+// Sine and cosine of the angle turns * 2 pi, for turns in [-0.5, 0.5], without branches.
+// Taylor series to the 20th power, accurate to 1e-9 over the range, and about a third of
+// the cost of the library sin and cos the warps below would otherwise call once a sample.
+inline void sin_cos_2pi(double turns, double& s, double& c)
+{
+    double x = 2 * pi * turns;
+    double x2 = x * x;
+
+    double ps = 1.0 / 121645100408832000.0; // 1 / 19!
+    ps = ps * -x2 + 1.0 / 355687428096000.0;
+    ps = ps * -x2 + 1.0 / 1307674368000.0;
+    ps = ps * -x2 + 1.0 / 6227020800.0;
+    ps = ps * -x2 + 1.0 / 39916800.0;
+    ps = ps * -x2 + 1.0 / 362880.0;
+    ps = ps * -x2 + 1.0 / 5040.0;
+    ps = ps * -x2 + 1.0 / 120.0;
+    ps = ps * -x2 + 1.0 / 6.0;
+    ps = ps * -x2 + 1.0;
+
+    double pc = 1.0 / 2432902008176640000.0; // 1 / 20!
+    pc = pc * -x2 + 1.0 / 6402373705728000.0;
+    pc = pc * -x2 + 1.0 / 20922789888000.0;
+    pc = pc * -x2 + 1.0 / 87178291200.0;
+    pc = pc * -x2 + 1.0 / 479001600.0;
+    pc = pc * -x2 + 1.0 / 3628800.0;
+    pc = pc * -x2 + 1.0 / 40320.0;
+    pc = pc * -x2 + 1.0 / 720.0;
+    pc = pc * -x2 + 1.0 / 24.0;
+    pc = pc * -x2 + 0.5;
+    pc = pc * -x2 + 1.0;
+
+    s = x * ps;
+    c = pc;
+}
+
+// A point on the unit circle at a uniform angle, which sin_cos_2pi measures from -pi.
+inline void sample_unit_circle(double u, double& x, double& y)
+{
+    sin_cos_2pi(u - 0.5, y, x);
+}
+
+// Uniform on the unit sphere (2 dimensions).
+inline vector3 sample_uniform_sphere(double u1, double u2)
+{
+    double z = 1 - 2 * u1;
+    double r = sqrt(fmax(0.0, 1 - z * z));
+    double x, y;
+    sample_unit_circle(u2, x, y);
+    return vector3(r * x, r * y, z);
+}
+
+inline double uniform_sphere_pdf()
+{
+    return 1 / (4 * pi);
+}
+
+// Uniform in the unit ball (3 dimensions): a direction, pushed out by the cube root so
+// the volume is covered evenly.
+inline vector3 sample_uniform_ball(double u1, double u2, double u3)
+{
+    return cbrt(u3) * sample_uniform_sphere(u1, u2);
+}
+
+// Uniform on the unit disk in the XY plane (2 dimensions), by Shirley and Chiu's
+// concentric map, which keeps neighbouring samples of the square neighbours on the disk.
+inline vector3 sample_concentric_disk(double u1, double u2)
+{
+    double a = 2 * u1 - 1;
+    double b = 2 * u2 - 1;
+    if (a == 0 && b == 0)
+        return vector3(0, 0, 0);
+
+    // Which of the two is larger is a coin flip, so both sides are worked out and one
+    // selected rather than branched to. The angle is in turns, within [-1/8, 3/8].
+    bool wide = fabs(a) > fabs(b);
+    double r = wide ? a : b;
+    double turns = wide ? (b / a) / 8 : 0.25 - (a / b) / 8;
+    double s, c;
+    sin_cos_2pi(turns, s, c);
+    return vector3(r * c, r * s, 0);
+}
+
+// Cosine weighted on the +Z hemisphere (2 dimensions): a disk sample lifted onto it.
+inline vector3 sample_cosine_hemisphere(double u1, double u2)
+{
+    vector3 d = sample_concentric_disk(u1, u2);
+    double z = sqrt(fmax(0.0, 1 - d.x() * d.x() - d.y() * d.y()));
+    return vector3(d.x(), d.y(), z);
+}
+
+inline double cosine_hemisphere_pdf(double cos_theta)
+{
+    return cos_theta < 0 ? 0 : cos_theta / pi;
+}
+
+// Uniform inside the cone around +Z whose half angle has cosine cos_theta_max
+// (2 dimensions).
+inline vector3 sample_uniform_cone(double cos_theta_max, double u1, double u2)
+{
+    double z = 1 + u2 * (cos_theta_max - 1);
+    double r = sqrt(fmax(0.0, 1 - z * z));
+    double x, y;
+    sample_unit_circle(u1, x, y);
+    return vector3(r * x, r * y, z);
+}
+
+inline double uniform_cone_pdf(double cos_theta_max)
+{
+    return 1 / (2 * pi * (1 - cos_theta_max));
+}
+
+// Microfacet normal around +Z distributed by the GGX (Trowbridge-Reitz) distribution D
+// times its cosine (2 dimensions), for rough materials; alpha is the roughness squared.
+inline vector3 sample_ggx_normal(double alpha, double u1, double u2)
+{
+    double tan2_theta = alpha * alpha * u1 / (1 - u1);
+    double cos_theta = 1 / sqrt(1 + tan2_theta);
+    double sin_theta = sqrt(fmax(0.0, 1 - cos_theta * cos_theta));
+    double x, y;
+    sample_unit_circle(u2, x, y);
+    return vector3(sin_theta * x, sin_theta * y, cos_theta);
+}
+
+// The GGX distribution D of a microfacet normal cos_theta away from the surface normal.
+inline double ggx_distribution(double alpha, double cos_theta)
+{
+    if (cos_theta <= 0)
+        return 0;
+    double a2 = alpha * alpha;
+    double d = cos_theta * cos_theta * (a2 - 1) + 1;
+    return a2 / (pi * d * d);
+}
+
+// Solid angle density of sample_ggx_normal.
+inline double ggx_normal_pdf(double alpha, double cos_theta)
+{
+    return ggx_distribution(alpha, cos_theta) * cos_theta;
+}
+
+// The same warps fed from the thread's random stream. The numbers are drawn into locals
+// first, since the order function arguments are evaluated in is unspecified.
+
+inline vector3 random_unit_vector()
+{
+    double u1 = random_double();
+    double u2 = random_double();
+    return sample_uniform_sphere(u1, u2);
+}
+
+inline vector3 random_in_unit_sphere()
+{
+    double u1 = random_double();
+    double u2 = random_double();
+    double u3 = random_double();
+    return sample_uniform_ball(u1, u2, u3);
+}
+
+inline vector3 random_in_hemisphere(const vector3& normal)
+{
+    vector3 in_unit_sphere = random_in_unit_sphere();
+    if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
+        return in_unit_sphere;
+    else
+        return -in_unit_sphere;
+}
+
+inline vector3 random_in_unit_disk()
+{
+    double u1 = random_double();
+    double u2 = random_double();
+    return sample_concentric_disk(u1, u2);
+}
+
+inline vector3 random_cosine_direction()
+{
+    double u1 = random_double();
+    double u2 = random_double();
+    return sample_cosine_hemisphere(u1, u2);
+}
+
+inline vector3 random_to_sphere(double radius, double distance_squared)
+{
+    // Uniform direction inside the cone (around +Z) that a sphere of the given radius
+    // subtends from distance_squared away.
+    double u1 = random_double();
+    double u2 = random_double();
+    return sample_uniform_cone(sqrt(1 - radius * radius / distance_squared), u1, u2);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+
+// Owen scrambled Sobol points, after Burley, "Practical Hash-based Owen Scrambling" (2020).
+// Only the first two Sobol dimensions are used. Every further pair of dimensions gets the
+// same 2D points, with the sample index shuffled by its own seed, so each pair stays
+// stratified over the first 2^k samples of the pixel while different pairs do not line up.
+
+constexpr uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+// Hash in which every bit only depends on itself and the bits below it, so applied to
+// reversed bits it flips every digit of a point depending on the digits before it: an Owen
+// scramble.
+inline uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+{
+    x ^= x * 0x3d20adeau;
+    x += seed;
+    x *= (seed >> 16) | 1;
+    x ^= x * 0x05526c56u;
+    x ^= x * 0x53a22864u;
+    return x;
+}
+
+// Sobol dimension 1 with the bits of both the index and the point reversed. It is linear
+// (over xor) in the bits, so it is the xor of what each byte maps to. Direction numbers of
+// the primitive polynomial x + 1: v[k] = v[k-1] ^ (v[k-1] >> 1).
+struct sobol_dimension1_table {
+    uint32_t bytes[4][256];
+
+    constexpr sobol_dimension1_table() : bytes{}
+    {
+        uint32_t v[32] = { 1u << 31 };
+        for (int k = 1; k < 32; k++)
+            v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+        for (int b = 0; b < 4; b++)
+            for (uint32_t x = 0; x < 256; x++)
+                for (int bit = 0; bit < 8; bit++)
+                    if (x >> bit & 1)
+                        bytes[b][x] ^= reverse_bits(v[31 - 8 * b - bit]);
+    }
+};
+
+inline constexpr sobol_dimension1_table sobol_dimension1_bytes;
+
+inline uint32_t sobol_dimension1_reversed(uint32_t reversed_index)
+{
+    const auto& t = sobol_dimension1_bytes.bytes;
+    uint32_t r = reversed_index;
+    return t[0][r & 0xff] ^ t[1][(r >> 8) & 0xff] ^ t[2][(r >> 16) & 0xff] ^ t[3][r >> 24];
+}
+
+// Both components of sample index of the 2D pattern seeded by seed, as 32 bit fixed point.
+inline void shuffled_scrambled_sobol(uint32_t index, uint64_t seed, uint32_t& x, uint32_t& y)
+{
+    // The index is shuffled by Owen scrambling it, which keeps the first 2^k samples one
+    // aligned block of 2^k Sobol points, itself stratified. Its reversed bits are Sobol
+    // dimension 0 (van der Corput), and what the dimension 1 table takes.
+    uint32_t reversed_shuffled = laine_karras_permutation(reverse_bits(index), static_cast<uint32_t>(seed));
+    uint32_t scramble = static_cast<uint32_t>(seed >> 32);
+    x = reverse_bits(laine_karras_permutation(reverse_bits(reversed_shuffled), scramble));
+    y = reverse_bits(laine_karras_permutation(sobol_dimension1_reversed(reversed_shuffled), scramble ^ 0x9e3779b9u));
+}
@@ -1,20 +1,28 @@
 #pragma once
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
+#include "sampling.h"
 #include "vector3.h"
 
 class sphere : public hittable {
 public:
     sphere() {}
     sphere(point3 cen, double r, shared_ptr<material> m)
-        : center(cen), radius(r), mat_ptr(m)
+        : center(cen), radius(r), mat(scene_materials.add(m))
     {
     };
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
 
-private:
-    static void get_sphere_uv(const point3& p, double& u, double& v)
+    virtual double pdf_value(const point3& o, const vector3& v) const override;
+    virtual vector3 random(const point3& o) const override;
+    virtual bool is_light() const override { return scene_materials[mat] && scene_materials[mat]->is_emissive(); }
+
+    static void get_sphere_uv(const point3& p, real& u, real& v)
     {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -32,8 +40,8 @@ private:
 
 public:
     point3 center = point3(0, 0, 0);
-    double radius = 1;
-    shared_ptr<material> mat_ptr;
+    real radius = 1;
+    material_handle mat = handle_table<material>::none;
 };
 
 inline bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
@@ -57,13 +65,18 @@ inline bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
     }
 
     rec.t = root;
+    rec.prim = this;
+
+    return true;
+}
+
+inline void sphere::finalize(const ray& r, hit_record& rec) const
+{
     rec.p = r.at(rec.t);
     vector3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
-
-    return true;
+    rec.mat = mat;
 }
 
 inline bool sphere::bounding_box(double time0, double time1, aabb& output_box) const
@@ -72,4 +85,49 @@ inline bool sphere::bounding_box(double time0, double time1, aabb& output_box) c
         center - vector3(radius, radius, radius),
         center + vector3(radius, radius, radius));
     return true;
+}
+
+inline double sphere::pdf_value(const point3& o, const vector3& v) const
+{
+    // Directions are sampled uniformly over the cone the sphere subtends, which does
+    // not exist from inside the sphere.
+    auto distance_squared = (center - o).length_squared();
+    if (distance_squared <= radius * radius)
+        return 0;
+
+    hit_record rec;
+    ray probe(o, v);
+    if (!this->hit(probe, surface_t_min(probe), infinity, rec))
+        return 0;
+
+    return uniform_cone_pdf(sqrt(1 - radius * radius / distance_squared));
+}
+
+inline vector3 sphere::random(const point3& o) const
+{
+    vector3 direction = center - o;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius)
+        return direction;
+
+    onb uvw;
+    uvw.build_from_w(direction);
+    return uvw.local(random_to_sphere(radius, distance_squared));
+}
+
+inline bool sphere::occluded(const ray& r, double t_min, double t_max) const
+{
+    vector3 oc = r.origin() - center;
+    double a = r.direction().length_squared();
+    double half_b = dot(oc, r.direction());
+    double c = oc.length_squared() - radius * radius;
+
+    double discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    double sqrtd = sqrt(discriminant);
+
+    double root = (-half_b - sqrtd) / a;
+    if (root >= t_min && root <= t_max) return true;
+    root = (-half_b + sqrtd) / a;
+    return root >= t_min && root <= t_max;
 }
\ No newline at end of file
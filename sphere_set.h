@@ -0,0 +1,332 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <typeinfo>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+#include "bvh.h"
+#include "cpu_features.h"
+
+// Many static spheres in structure of arrays form, intersected several at a time with
+// SSE2 / AVX2 / AVX-512 (2 / 4 / 8 doubles per instruction), picked at runtime from
+// cpu_features::level. Doubles keep the results equal to the scalar sphere::hit, which
+// the large ground spheres of our scenes need.
+// The flattened BVHs pack small subtrees of spheres into one of these as a single leaf.
+class sphere_set : public hittable {
+public:
+    // Arrays are padded to a multiple of the widest vector so every kernel can run
+    // over whole registers. Padding lanes have NaN centers and never hit.
+    static constexpr int lane_padding = 8;
+
+    sphere_set() {}
+
+    void add(const point3& center, double radius, material_handle mat)
+    {
+        size_t i = count++;
+        if (i == center_x.size())
+        {
+            size_t padded = center_x.size() + lane_padding;
+            double nan = std::numeric_limits<double>::quiet_NaN();
+            center_x.resize(padded, nan);
+            center_y.resize(padded, nan);
+            center_z.resize(padded, nan);
+            radii.resize(padded, 0.0);
+            materials.resize(padded, handle_table<material>::none);
+        }
+
+        center_x[i] = center.x();
+        center_y[i] = center.y();
+        center_z[i] = center.z();
+        radii[i] = radius;
+        materials[i] = mat;
+
+        aabb b(center - vector3(radius, radius, radius), center + vector3(radius, radius, radius));
+        box = i == 0 ? b : surrounding_box(box, b);
+    }
+
+    void add(const sphere& s) { add(s.center, s.radius, s.mat); }
+
+    size_t size() const { return count; }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override
+    {
+        int index = intersect(r, t_min, t_max, false);
+        if (index < 0)
+            return false;
+
+        rec.t = t_max;
+        rec.prim = this;
+        rec.prim_index = index;
+        return true;
+    }
+
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override
+    {
+        return intersect(r, t_min, t_max, true) >= 0;
+    }
+
+    virtual void finalize(const ray& r, hit_record& rec) const override
+    {
+        int i = rec.prim_index;
+        point3 center(center_x[i], center_y[i], center_z[i]);
+
+        rec.p = r.at(rec.t);
+        vector3 outward_normal = (rec.p - center) / radii[i];
+        rec.set_face_normal(r, outward_normal);
+        sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.mat = materials[i];
+    }
+
+    virtual bool bounding_box(double, double, aabb& output_box) const override
+    {
+        output_box = box;
+        return count > 0;
+    }
+
+    // Index of the closest sphere hit in [t_min, t_max] (any sphere if any_hit), with
+    // t_max moved to its distance, or -1.
+    int intersect(const ray& r, double t_min, double& t_max, bool any_hit) const
+    {
+        switch (cpu_features::level)
+        {
+#ifdef RT_X86_64
+        case simd_level::avx512: return intersect_avx512(r, t_min, t_max, any_hit);
+        case simd_level::avx2: return intersect_avx2(r, t_min, t_max, any_hit);
+        case simd_level::sse2: return intersect_sse2(r, t_min, t_max, any_hit);
+#endif
+        default: return intersect_scalar(r, t_min, t_max, any_hit);
+        }
+    }
+
+public:
+    std::vector<double> center_x, center_y, center_z, radii;
+    std::vector<material_handle> materials;
+    size_t count = 0;
+    aabb box;
+
+private:
+    int intersect_scalar(const ray& r, double t_min, double& t_max, bool any_hit) const;
+#ifdef RT_X86_64
+    int intersect_sse2(const ray& r, double t_min, double& t_max, bool any_hit) const;
+    RT_TARGET_AVX2 int intersect_avx2(const ray& r, double t_min, double& t_max, bool any_hit) const;
+    RT_TARGET_AVX512 int intersect_avx512(const ray& r, double t_min, double& t_max, bool any_hit) const;
+#endif
+
+    // Every kernel computes, per sphere, the same roots as sphere::hit and keeps the
+    // nearer one inside [t_min, t_max]. Lanes that hit are then compared in scalar code,
+    // which is rare enough not to matter; ties go to the later sphere, as in intersect_scalar.
+    bool closer_lanes(int mask, const double* t, size_t first, int lanes, double& t_max, int& best, bool any_hit) const
+    {
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            if ((mask >> lane & 1) && t[lane] <= t_max)
+            {
+                t_max = t[lane];
+                best = static_cast<int>(first + lane);
+                if (any_hit) return true;
+            }
+        }
+        return false;
+    }
+};
+
+inline int sphere_set::intersect_scalar(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    const point3 o = r.origin();
+    const vector3 d = r.direction();
+    const double a = d.length_squared();
+    int best = -1;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        vector3 oc = o - point3(center_x[i], center_y[i], center_z[i]);
+        double half_b = dot(oc, d);
+        double c = oc.length_squared() - radii[i] * radii[i];
+
+        double discriminant = half_b * half_b - a * c;
+        if (discriminant < 0) continue;
+        double sqrtd = sqrt(discriminant);
+
+        double root = (-half_b - sqrtd) / a;
+        if (root < t_min || t_max < root)
+        {
+            root = (-half_b + sqrtd) / a;
+            if (root < t_min || t_max < root)
+                continue;
+        }
+
+        t_max = root;
+        best = static_cast<int>(i);
+        if (any_hit) break;
+    }
+    return best;
+}
+
+#ifdef RT_X86_64
+inline int sphere_set::intersect_sse2(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    const __m128d ox = _mm_set1_pd(r.origin().x()), oy = _mm_set1_pd(r.origin().y()), oz = _mm_set1_pd(r.origin().z());
+    const __m128d dx = _mm_set1_pd(r.direction().x()), dy = _mm_set1_pd(r.direction().y()), dz = _mm_set1_pd(r.direction().z());
+    const __m128d a = _mm_set1_pd(r.direction().length_squared());
+    const __m128d tmin = _mm_set1_pd(t_min);
+    const __m128d zero = _mm_setzero_pd();
+    alignas(16) double t[2];
+    int best = -1;
+
+    for (size_t i = 0; i < count; i += 2)
+    {
+        __m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(&center_x[i]));
+        __m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(&center_y[i]));
+        __m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(&center_z[i]));
+        __m128d radius = _mm_loadu_pd(&radii[i]);
+
+        __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+        __m128d c = _mm_sub_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)), _mm_mul_pd(radius, radius));
+        __m128d discriminant = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+        __m128d valid = _mm_cmpge_pd(discriminant, zero);
+        if (_mm_movemask_pd(valid) == 0) continue;
+
+        __m128d sqrtd = _mm_sqrt_pd(_mm_max_pd(discriminant, zero));
+        __m128d neg_b = _mm_sub_pd(zero, half_b);
+        __m128d tmax = _mm_set1_pd(t_max);
+        __m128d near_root = _mm_div_pd(_mm_sub_pd(neg_b, sqrtd), a);
+        __m128d far_root = _mm_div_pd(_mm_add_pd(neg_b, sqrtd), a);
+        __m128d near_in = _mm_and_pd(_mm_cmpge_pd(near_root, tmin), _mm_cmple_pd(near_root, tmax));
+        __m128d far_in = _mm_and_pd(_mm_cmpge_pd(far_root, tmin), _mm_cmple_pd(far_root, tmax));
+
+        __m128d root = _mm_or_pd(_mm_and_pd(near_in, near_root), _mm_andnot_pd(near_in, far_root));
+        int mask = _mm_movemask_pd(_mm_and_pd(valid, _mm_or_pd(near_in, far_in)));
+        if (mask == 0) continue;
+
+        _mm_store_pd(t, root);
+        if (closer_lanes(mask, t, i, 2, t_max, best, any_hit)) break;
+    }
+    return best;
+}
+
+RT_TARGET_AVX2 inline int sphere_set::intersect_avx2(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    const __m256d ox = _mm256_set1_pd(r.origin().x()), oy = _mm256_set1_pd(r.origin().y()), oz = _mm256_set1_pd(r.origin().z());
+    const __m256d dx = _mm256_set1_pd(r.direction().x()), dy = _mm256_set1_pd(r.direction().y()), dz = _mm256_set1_pd(r.direction().z());
+    const __m256d a = _mm256_set1_pd(r.direction().length_squared());
+    const __m256d tmin = _mm256_set1_pd(t_min);
+    const __m256d zero = _mm256_setzero_pd();
+    alignas(32) double t[4];
+    int best = -1;
+
+    for (size_t i = 0; i < count; i += 4)
+    {
+        __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(&center_x[i]));
+        __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(&center_y[i]));
+        __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(&center_z[i]));
+        __m256d radius = _mm256_loadu_pd(&radii[i]);
+
+        __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+        __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)), _mm256_mul_pd(radius, radius));
+        __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+        __m256d valid = _mm256_cmp_pd(discriminant, zero, _CMP_GE_OQ);
+        if (_mm256_movemask_pd(valid) == 0) continue;
+
+        __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(discriminant, zero));
+        __m256d neg_b = _mm256_sub_pd(zero, half_b);
+        __m256d tmax = _mm256_set1_pd(t_max);
+        __m256d near_root = _mm256_div_pd(_mm256_sub_pd(neg_b, sqrtd), a);
+        __m256d far_root = _mm256_div_pd(_mm256_add_pd(neg_b, sqrtd), a);
+        __m256d near_in = _mm256_and_pd(_mm256_cmp_pd(near_root, tmin, _CMP_GE_OQ), _mm256_cmp_pd(near_root, tmax, _CMP_LE_OQ));
+        __m256d far_in = _mm256_and_pd(_mm256_cmp_pd(far_root, tmin, _CMP_GE_OQ), _mm256_cmp_pd(far_root, tmax, _CMP_LE_OQ));
+
+        __m256d root = _mm256_blendv_pd(far_root, near_root, near_in);
+        int mask = _mm256_movemask_pd(_mm256_and_pd(valid, _mm256_or_pd(near_in, far_in)));
+        if (mask == 0) continue;
+
+        _mm256_store_pd(t, root);
+        if (closer_lanes(mask, t, i, 4, t_max, best, any_hit)) break;
+    }
+    return best;
+}
+
+RT_TARGET_AVX512 inline int sphere_set::intersect_avx512(const ray& r, double t_min, double& t_max, bool any_hit) const
+{
+    const __m512d ox = _mm512_set1_pd(r.origin().x()), oy = _mm512_set1_pd(r.origin().y()), oz = _mm512_set1_pd(r.origin().z());
+    const __m512d dx = _mm512_set1_pd(r.direction().x()), dy = _mm512_set1_pd(r.direction().y()), dz = _mm512_set1_pd(r.direction().z());
+    const __m512d a = _mm512_set1_pd(r.direction().length_squared());
+    const __m512d tmin = _mm512_set1_pd(t_min);
+    const __m512d zero = _mm512_setzero_pd();
+    alignas(64) double t[8];
+    int best = -1;
+
+    for (size_t i = 0; i < count; i += 8)
+    {
+        __m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(&center_x[i]));
+        __m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(&center_y[i]));
+        __m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(&center_z[i]));
+        __m512d radius = _mm512_loadu_pd(&radii[i]);
+
+        __m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, dx), _mm512_mul_pd(ocy, dy)), _mm512_mul_pd(ocz, dz));
+        __m512d c = _mm512_sub_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)), _mm512_mul_pd(radius, radius));
+        __m512d discriminant = _mm512_sub_pd(_mm512_mul_pd(half_b, half_b), _mm512_mul_pd(a, c));
+        __mmask8 valid = _mm512_cmp_pd_mask(discriminant, zero, _CMP_GE_OQ);
+        if (valid == 0) continue;
+
+        // Only the valid lanes, whose discriminant is not negative, take the root; the
+        // others are left zero. (The unmasked intrinsics start from an undefined register,
+        // which GCC warns about.)
+        __m512d sqrtd = _mm512_mask_sqrt_pd(zero, valid, discriminant);
+        __m512d neg_b = _mm512_sub_pd(zero, half_b);
+        __m512d tmax = _mm512_set1_pd(t_max);
+        __m512d near_root = _mm512_div_pd(_mm512_sub_pd(neg_b, sqrtd), a);
+        __m512d far_root = _mm512_div_pd(_mm512_add_pd(neg_b, sqrtd), a);
+        __mmask8 near_in = _mm512_cmp_pd_mask(near_root, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(near_root, tmax, _CMP_LE_OQ);
+        __mmask8 far_in = _mm512_cmp_pd_mask(far_root, tmin, _CMP_GE_OQ) & _mm512_cmp_pd_mask(far_root, tmax, _CMP_LE_OQ);
+
+        __m512d root = _mm512_mask_blend_pd(near_in, far_root, near_root);
+        int mask = valid & (near_in | far_in);
+        if (mask == 0) continue;
+
+        _mm512_store_pd(t, root);
+        if (closer_lanes(mask, t, i, 8, t_max, best, any_hit)) break;
+    }
+    return best;
+}
+#endif
+
+// Gathers the spheres under node, giving up on anything else or on more than limit.
+inline bool collect_spheres(const bvh_node& node, std::vector<const sphere*>& spheres, size_t limit)
+{
+    // A single object node has left == right.
+    int child_count = node.left == node.right ? 1 : 2;
+    for (int i = 0; i < child_count; i++)
+    {
+        const auto& child = i == 0 ? node.left : node.right;
+        if (auto child_node = dynamic_cast<const bvh_node*>(child.get()))
+        {
+            if (!collect_spheres(*child_node, spheres, limit))
+                return false;
+            continue;
+        }
+
+        if (typeid(*child) != typeid(sphere) || spheres.size() == limit)
+            return false;
+        spheres.push_back(static_cast<const sphere*>(child.get()));
+    }
+    return true;
+}
+
+// One sphere_set holding every sphere of the subtree, or nullptr when the subtree has
+// anything but plain spheres, fewer than two or more than limit of them.
+inline shared_ptr<sphere_set> pack_spheres(const bvh_node& node, int limit)
+{
+    std::vector<const sphere*> spheres;
+    if (limit < 2 || !collect_spheres(node, spheres, limit) || spheres.size() < 2)
+        return nullptr;
+
+    auto set = make_shared<sphere_set>();
+    for (const sphere* s : spheres)
+        set->add(*s);
+    return set;
+}
@@ -3,6 +3,7 @@
 #include "ray_trace_engine.h"
 #include "perlin.h"
 #include "rt_stb_image.h"
+#include "handle_table.h"
 
 #include <iostream>
 
@@ -11,6 +12,11 @@ public:
     virtual color value(double u, double v, const point3& p) const = 0;
 };
 
+using texture_handle = handle_table<texture>::handle;
+
+// Every texture referenced by the loaded scene.
+inline handle_table<texture> scene_textures;
+
 class solid_color : public texture {
 public:
     solid_color() {}
@@ -35,24 +41,24 @@ public:
     checker_texture() {}
 
     checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd)
-        : even(_even), odd(_odd)
+        : odd(scene_textures.add(_odd)), even(scene_textures.add(_even))
     {}
 
     checker_texture(color c1, color c2)
-        : even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2))
+        : checker_texture(make_shared<solid_color>(c1), make_shared<solid_color>(c2))
     {}
 
     virtual color value(double u, double v, const point3& p) const override{
         auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
         if (sines < 0)
-            return odd->value(u, v, p);
+            return scene_textures[odd]->value(u, v, p);
         else
-            return even->value(u, v, p);
+            return scene_textures[even]->value(u, v, p);
     }
 
 public:
-    shared_ptr<texture> odd;
-    shared_ptr<texture> even;
+    texture_handle odd;
+    texture_handle even;
 };
 
 class noise_texture : public texture {
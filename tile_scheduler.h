@@ -0,0 +1,98 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// A rectangular block of pixels, [x0, x1) x [y0, y1) in image buffer coordinates (row 0 at the top).
+struct tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Double ended tile queue owned by one render thread.
+// The owner takes work from the front, idle threads steal from the back so they pick up
+// the tiles the owner would have reached last. Tiles are coarse enough that a plain mutex
+// is never contended for long.
+class tile_queue {
+public:
+    void push(const tile& t)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        tiles.push_back(t);
+    }
+
+    bool pop(tile& t)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (tiles.empty()) return false;
+        t = tiles.front();
+        tiles.pop_front();
+        return true;
+    }
+
+    bool steal(tile& t)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (tiles.empty()) return false;
+        t = tiles.back();
+        tiles.pop_back();
+        return true;
+    }
+
+private:
+    std::deque<tile> tiles;
+    std::mutex mtx;
+};
+
+// Splits the image into square tiles and hands them out to the render threads.
+// Every thread starts with a contiguous band of tiles in its own queue and steals from
+// the other queues once its own runs dry, so expensive regions get spread over all cores.
+class tile_scheduler {
+public:
+    // Tiles for which keep returns false (e.g. fully converged ones) are left out.
+    tile_scheduler(int width, int height, int worker_count, int tile_size = 32, const std::function<bool(const tile&)>& keep = nullptr)
+        : queues(std::max(worker_count, 1)), finished(0)
+    {
+        tile_size = std::max(tile_size, 1);
+
+        std::vector<tile> all_tiles;
+        for (int y = 0; y < height; y += tile_size){
+            for (int x = 0; x < width; x += tile_size){
+                tile t = { x, y, std::min(x + tile_size, width), std::min(y + tile_size, height) };
+                if (!keep || keep(t)) all_tiles.push_back(t);
+            }
+        }
+        total = all_tiles.size();
+
+        size_t per_worker = (total + queues.size() - 1) / queues.size();
+        for (size_t i = 0; i < total; i++){
+            queues[i / std::max<size_t>(per_worker, 1)].push(all_tiles[i]);
+        }
+    }
+
+    // Fetches the next tile for the given worker, stealing if needed. Returns false when the image is done.
+    bool next_tile(int worker, tile& t)
+    {
+        if (queues[worker].pop(t)) return true;
+
+        for (size_t i = 1; i < queues.size(); i++){
+            if (queues[(worker + i) % queues.size()].steal(t)) return true;
+        }
+        return false;
+    }
+
+    void tile_done() { finished++; }
+
+    size_t tiles_finished() const { return finished; }
+    size_t tile_count() const { return total; }
+    int worker_count() const { return static_cast<int>(queues.size()); }
+
+private:
+    std::vector<tile_queue> queues;
+    std::atomic<size_t> finished;
+    size_t total = 0;
+};
@@ -0,0 +1,216 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "ray_trace_engine.h"
+#include "hittable.h"
+#include "material.h"
+#include "bvh.h"
+#include "flat_bvh.h"
+
+// Vertex data of a triangle mesh. Triangles index into shared arrays; normal and uv
+// indices are optional per corner (triangle_mesh_data::none) and the arrays are left
+// empty when no triangle uses them.
+struct triangle_mesh_data {
+    static constexpr uint32_t none = ~uint32_t(0);
+
+    std::vector<point3> positions;
+    std::vector<vector3> normals;
+    std::vector<real> uvs;                // u, v pairs
+    std::vector<uint32_t> vertex_indices; // three per triangle
+    std::vector<uint32_t> normal_indices; // three per triangle, or empty
+    std::vector<uint32_t> uv_indices;     // three per triangle, or empty
+
+    size_t triangle_count() const { return vertex_indices.size() / 3; }
+};
+
+// An indexed triangle mesh with its own BVH over the triangles, so a whole model is one
+// object to the scene's acceleration structure. Triangles are intersected with the
+// Moller-Trumbore test; hit() only records the triangle and finalize() works out the
+// interpolated normal and texture coordinates.
+class triangle_mesh : public hittable {
+public:
+    static constexpr int leaf_size = 4;
+
+    triangle_mesh(triangle_mesh_data data, shared_ptr<material> m);
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+    virtual bool occluded(const ray& r, double t_min, double t_max) const override;
+
+    virtual bool bounding_box(double, double, aabb& output_box) const override
+    {
+        output_box = box;
+        return !nodes.empty();
+    }
+
+    size_t triangle_count() const { return mesh.triangle_count(); }
+
+    size_t memory_bytes() const
+    {
+        return mesh.positions.capacity() * sizeof(point3) + mesh.normals.capacity() * sizeof(vector3)
+            + mesh.uvs.capacity() * sizeof(real)
+            + (mesh.vertex_indices.capacity() + mesh.normal_indices.capacity() + mesh.uv_indices.capacity()) * sizeof(uint32_t)
+            + nodes.capacity() * sizeof(flat_bvh_node);
+    }
+
+public:
+    triangle_mesh_data mesh;
+    material_handle mat = handle_table<material>::none;
+    std::vector<flat_bvh_node> nodes;
+    aabb box;
+    int depth = 0;
+
+private:
+    // Distance to triangle tri along r, with the barycentric coordinates of the hit point.
+    bool intersect(uint32_t tri, const ray& r, double t_min, double t_max, double& t, double& b1, double& b2) const;
+
+};
+
+inline triangle_mesh::triangle_mesh(triangle_mesh_data data, shared_ptr<material> m)
+    : mesh(std::move(data)), mat(scene_materials.add(m))
+{
+    size_t count = mesh.triangle_count();
+    if (count == 0)
+        return;
+
+    std::vector<bvh_build_primitive> primitives(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        const point3& a = mesh.positions[mesh.vertex_indices[3 * i]];
+        const point3& b = mesh.positions[mesh.vertex_indices[3 * i + 1]];
+        const point3& c = mesh.positions[mesh.vertex_indices[3 * i + 2]];
+        point3 lo(fmin(a.x(), fmin(b.x(), c.x())), fmin(a.y(), fmin(b.y(), c.y())), fmin(a.z(), fmin(b.z(), c.z())));
+        point3 hi(fmax(a.x(), fmax(b.x(), c.x())), fmax(a.y(), fmax(b.y(), c.y())), fmax(a.z(), fmax(b.z(), c.z())));
+        primitives[i] = { aabb(lo, hi), box_centroid(aabb(lo, hi)), i };
+    }
+
+    nodes.reserve(2 * count / leaf_size + 1);
+    flat_bvh::build_nodes(nodes, depth, primitives, 0, count, leaf_size);
+    box = aabb(
+        point3(nodes[0].bounds_min[0], nodes[0].bounds_min[1], nodes[0].bounds_min[2]),
+        point3(nodes[0].bounds_max[0], nodes[0].bounds_max[1], nodes[0].bounds_max[2]));
+
+    // Store the triangles in leaf order, so every leaf is one contiguous range.
+    auto reorder = [&primitives](std::vector<uint32_t>& indices) {
+        if (indices.empty()) return;
+        std::vector<uint32_t> sorted(indices.size());
+        for (size_t i = 0; i < primitives.size(); i++)
+            std::copy_n(&indices[3 * primitives[i].index], 3, &sorted[3 * i]);
+        indices.swap(sorted);
+    };
+    reorder(mesh.vertex_indices);
+    reorder(mesh.normal_indices);
+    reorder(mesh.uv_indices);
+}
+
+inline bool triangle_mesh::intersect(uint32_t tri, const ray& r, double t_min, double t_max, double& t, double& b1, double& b2) const
+{
+    const point3& v0 = mesh.positions[mesh.vertex_indices[3 * tri]];
+    const point3& v1 = mesh.positions[mesh.vertex_indices[3 * tri + 1]];
+    const point3& v2 = mesh.positions[mesh.vertex_indices[3 * tri + 2]];
+
+    vector3 e1 = v1 - v0;
+    vector3 e2 = v2 - v0;
+    vector3 pvec = cross(r.direction(), e2);
+    double det = dot(e1, pvec);
+    if (det == 0)
+        return false;
+
+    double inv_det = 1 / det;
+    vector3 tvec = r.origin() - v0;
+    b1 = dot(tvec, pvec) * inv_det;
+    if (b1 < 0 || b1 > 1)
+        return false;
+
+    vector3 qvec = cross(tvec, e1);
+    b2 = dot(r.direction(), qvec) * inv_det;
+    if (b2 < 0 || b1 + b2 > 1)
+        return false;
+
+    t = dot(e2, qvec) * inv_det;
+    return t >= t_min && t <= t_max;
+}
+
+inline bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
+{
+    bool hit_anything = false;
+
+    flat_bvh::traverse(nodes, depth, r, t_min, t_max, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            double t, b1, b2;
+            if (intersect(i, r, t_min, closest, t, b1, b2))
+            {
+                hit_anything = true;
+                closest = t;
+                rec.t = t;
+                rec.prim = this;
+                rec.prim_index = i;
+            }
+        }
+        return false;
+    });
+
+    return hit_anything;
+}
+
+inline bool triangle_mesh::occluded(const ray& r, double t_min, double t_max) const
+{
+    bool blocked = false;
+
+    flat_bvh::traverse(nodes, depth, r, t_min, t_max, [&](int first, int count, double& closest) {
+        for (int i = first; i < first + count; i++)
+        {
+            double t, b1, b2;
+            if (intersect(i, r, t_min, closest, t, b1, b2))
+                return blocked = true;
+        }
+        return false;
+    });
+
+    return blocked;
+}
+
+inline void triangle_mesh::finalize(const ray& r, hit_record& rec) const
+{
+    uint32_t tri = static_cast<uint32_t>(rec.prim_index);
+    double t, b1, b2;
+    intersect(tri, r, -infinity, infinity, t, b1, b2);
+    double b0 = 1 - b1 - b2;
+
+    const point3& v0 = mesh.positions[mesh.vertex_indices[3 * tri]];
+    const point3& v1 = mesh.positions[mesh.vertex_indices[3 * tri + 1]];
+    const point3& v2 = mesh.positions[mesh.vertex_indices[3 * tri + 2]];
+    rec.p = r.at(rec.t);
+
+    vector3 normal = unit_vector(cross(v1 - v0, v2 - v0));
+    if (!mesh.normal_indices.empty())
+    {
+        uint32_t n0 = mesh.normal_indices[3 * tri], n1 = mesh.normal_indices[3 * tri + 1], n2 = mesh.normal_indices[3 * tri + 2];
+        if (n0 != triangle_mesh_data::none && n1 != triangle_mesh_data::none && n2 != triangle_mesh_data::none)
+        {
+            vector3 shading = b0 * mesh.normals[n0] + b1 * mesh.normals[n1] + b2 * mesh.normals[n2];
+            if (shading.length_squared() > 0)
+                normal = unit_vector(shading);
+        }
+    }
+    rec.set_face_normal(r, normal);
+
+    rec.u = b1;
+    rec.v = b2;
+    if (!mesh.uv_indices.empty())
+    {
+        uint32_t t0 = mesh.uv_indices[3 * tri], t1 = mesh.uv_indices[3 * tri + 1], t2 = mesh.uv_indices[3 * tri + 2];
+        if (t0 != triangle_mesh_data::none && t1 != triangle_mesh_data::none && t2 != triangle_mesh_data::none)
+        {
+            rec.u = b0 * mesh.uvs[2 * t0] + b1 * mesh.uvs[2 * t1] + b2 * mesh.uvs[2 * t2];
+            rec.v = b0 * mesh.uvs[2 * t0 + 1] + b1 * mesh.uvs[2 * t1 + 1] + b2 * mesh.uvs[2 * t2 + 1];
+        }
+    }
+
+    rec.mat = mat;
+}
@@ -5,21 +5,29 @@
 #include "ray_trace_engine.h"
 
 using std::sqrt;
-class vector3
+
+// A vector of three T. The renderer works in vector3, whose components are real; sums
+// that must not lose precision, like the film's, use vector3_t<double> in every build.
+template <typename T>
+class vector3_t
 {
 public:
-    vector3() : e{ 0,0,0 } {}
-    vector3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+    using scalar = T;
+
+    vector3_t() : e{ 0,0,0 } {}
+    vector3_t(T e0, T e1, T e2) : e{ e0, e1, e2 } {}
+    template <typename U>
+    explicit vector3_t(const vector3_t<U>& v) : e{ T(v.e[0]), T(v.e[1]), T(v.e[2]) } {}
 
-    double x() const { return e[0]; }
-    double y() const { return e[1]; }
-    double z() const { return e[2]; }
+    T x() const { return e[0]; }
+    T y() const { return e[1]; }
+    T z() const { return e[2]; }
 
-    vector3 operator-() const { return vector3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+    vector3_t operator-() const { return vector3_t(-e[0], -e[1], -e[2]); }
+    T operator[](int i) const { return e[i]; }
+    T& operator[](int i) { return e[i]; }
 
-    vector3& operator+=(const vector3& v)
+    vector3_t& operator+=(const vector3_t& v)
     {
         e[0] += v.e[0];
         e[1] += v.e[1];
@@ -27,7 +35,7 @@ public:
         return *this;
     }
 
-    vector3& operator*=(const double t)
+    vector3_t& operator*=(const T t)
     {
         e[0] *= t;
         e[1] *= t;
@@ -35,29 +43,29 @@ public:
         return *this;
     }
 
-    vector3& operator/=(const double t)
+    vector3_t& operator/=(const T t)
     {
         return *this *= 1 / t;
     }
 
-    double length() const
+    T length() const
     {
         return sqrt(length_squared());
     }
 
-    double length_squared() const
+    T length_squared() const
     {
         return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
 
-    inline static vector3 random()
+    inline static vector3_t random()
     {
-        return vector3(random_double(), random_double(), random_double());
+        return vector3_t(random_double(), random_double(), random_double());
     }
 
-    inline static vector3 random(double min, double max)
+    inline static vector3_t random(double min, double max)
     {
-        return vector3(random_double(min, max), random_double(min, max), random_double(min, max));
+        return vector3_t(random_double(min, max), random_double(min, max), random_double(min, max));
     }
 
     bool near_zero() const
@@ -68,112 +76,92 @@ public:
     }
 
 public:
-    double e[3];
+    T e[3];
 };
 
 // Type aliases for vector3
+using vector3 = vector3_t<real>;
 using point3 = vector3;   // 3D point
 using color = vector3;    // RGB color
 
 // vector3 Utility Functions
 
-inline std::ostream& operator<<(std::ostream& out, const vector3& v)
+template <typename T>
+inline std::ostream& operator<<(std::ostream& out, const vector3_t<T>& v)
 {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
-inline vector3 operator+(const vector3& u, const vector3& v)
+template <typename T>
+inline vector3_t<T> operator+(const vector3_t<T>& u, const vector3_t<T>& v)
 {
-    return vector3(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
+    return vector3_t<T>(u.e[0] + v.e[0], u.e[1] + v.e[1], u.e[2] + v.e[2]);
 }
 
-inline vector3 operator-(const vector3& u, const vector3& v)
+template <typename T>
+inline vector3_t<T> operator-(const vector3_t<T>& u, const vector3_t<T>& v)
 {
-    return vector3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+    return vector3_t<T>(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
 }
 
-inline vector3 operator*(const vector3& u, const vector3& v)
+template <typename T>
+inline vector3_t<T> operator*(const vector3_t<T>& u, const vector3_t<T>& v)
 {
-    return vector3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+    return vector3_t<T>(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
 }
 
-inline vector3 operator*(double t, const vector3& v)
+// The scalar operands are not deduced, so doubles and ints scale vectors of either type.
+template <typename T>
+inline vector3_t<T> operator*(typename vector3_t<T>::scalar t, const vector3_t<T>& v)
 {
-    return vector3(t * v.e[0], t * v.e[1], t * v.e[2]);
+    return vector3_t<T>(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
-inline vector3 operator*(const vector3& v, double t)
+template <typename T>
+inline vector3_t<T> operator*(const vector3_t<T>& v, typename vector3_t<T>::scalar t)
 {
     return t * v;
 }
 
-inline vector3 operator/(vector3 v, double t)
+template <typename T>
+inline vector3_t<T> operator/(vector3_t<T> v, typename vector3_t<T>::scalar t)
 {
     return (1 / t) * v;
 }
 
-inline double dot(const vector3& u, const vector3& v)
+template <typename T>
+inline T dot(const vector3_t<T>& u, const vector3_t<T>& v)
 {
     return u.e[0] * v.e[0]
         + u.e[1] * v.e[1]
         + u.e[2] * v.e[2];
 }
 
-inline vector3 cross(const vector3& u, const vector3& v)
+template <typename T>
+inline vector3_t<T> cross(const vector3_t<T>& u, const vector3_t<T>& v)
 {
-    return vector3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+    return vector3_t<T>(u.e[1] * v.e[2] - u.e[2] * v.e[1],
         u.e[2] * v.e[0] - u.e[0] * v.e[2],
         u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
-inline vector3 unit_vector(vector3 v)
+template <typename T>
+inline vector3_t<T> unit_vector(vector3_t<T> v)
 {
     return v / v.length();
 }
 
-inline vector3 random_in_unit_sphere()
-{
-    while (true)
-    {
-        auto p = vector3::random(-1, 1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
-}
-
-inline vector3 random_unit_vector()
-{
-    return unit_vector(random_in_unit_sphere());
-}
-
-inline vector3 random_in_hemisphere(const vector3& normal)
-{
-    vector3 in_unit_sphere = random_in_unit_sphere();
-    if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
-        return in_unit_sphere;
-    else
-        return -in_unit_sphere;
-}
-
-inline vector3 reflect(const vector3& v, const vector3& n)
+template <typename T>
+inline vector3_t<T> reflect(const vector3_t<T>& v, const vector3_t<T>& n)
 {
     return v - 2 * dot(v, n) * n;
 }
 
-inline vector3 refract(const vector3& uv, const vector3& n, double etai_over_etat)
+template <typename T>
+inline vector3_t<T> refract(const vector3_t<T>& uv, const vector3_t<T>& n, double etai_over_etat)
 {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
-    vector3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
-    vector3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+    T cos_theta = fmin(dot(-uv, n), T(1));
+    vector3_t<T> r_out_perp = etai_over_etat * (uv + cos_theta * n);
+    vector3_t<T> r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
-
-inline vector3 random_in_unit_disk()
-{
-    while (true)
-    {
-        auto p = vector3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
-}
\ No newline at end of file